@@ -0,0 +1,939 @@
+// Compares simulation in float and double, in 3D and 2D: time per step and
+// quality of the final layout. With --scaling, measures how a step scales
+// with the number of threads on a power-law graph. With --snapshots,
+// measures how saving positions affects the time of a step. With --suite,
+// prints time of every phase of a step on generated graphs as CSV, to be
+// compared between versions. With --sharded, compares Layout with
+// ShardedLayout in several processes. With --batch, compares a Layout per
+// graph with BatchLayout on many small graphs. With --checkpoint, times
+// saving and resuming the full state. See --help for the other modes.
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include <omp.h>
+
+#include "layout.h"
+#include "sharded.h"
+#include "batch.h"
+#include "Random.h"
+#include "snapshot.h"
+
+using namespace std;
+
+// Links of a side x side x side grid in the links.bin format: -(from + 1)
+// followed by (to + 1) of every neighbour.
+vector<int> makeGrid(int side) {
+    vector<int> links;
+    for (int x = 0; x < side; ++x) {
+        for (int y = 0; y < side; ++y) {
+            for (int z = 0; z < side; ++z) {
+                int id = (x * side + y) * side + z;
+                links.push_back(-(id + 1));
+                if (x + 1 < side) links.push_back(id + side * side + 1);
+                if (y + 1 < side) links.push_back(id + side + 1);
+                if (z + 1 < side) links.push_back(id + 1 + 1);
+            }
+        }
+    }
+    return links;
+}
+
+// Barabasi-Albert graph: every new node links to `edges` existing nodes,
+// picked with probability proportional to their degree. Degrees follow a
+// power law, so a few hubs have thousands of springs.
+vector<int> makePowerLaw(int nodes, int edges) {
+    Random random(42);
+    vector<int> ends; // every link adds both of its nodes
+    vector<int> links;
+    for (int id = 0; id < nodes; ++id) {
+        links.push_back(-(id + 1));
+        for (int k = 0; k < edges && k < id; ++k) {
+            int to = ends.empty() ? 0 : ends[(size_t)random.next(ends.size())];
+            links.push_back(to + 1);
+            ends.push_back(to);
+            ends.push_back(id);
+        }
+    }
+    return links;
+}
+
+// Links in the links.bin format from a list of targets per node.
+vector<int> toLinks(const vector<vector<int>> &targets) {
+    vector<int> links;
+    for (size_t from = 0; from < targets.size(); ++from) {
+        links.push_back(-(int)(from + 1));
+        for (size_t i = 0; i < targets[from].size(); ++i) links.push_back(targets[from][i] + 1);
+    }
+    return links;
+}
+
+// Erdos-Renyi graph: nodes * degree / 2 links between uniformly random
+// pairs of nodes, so an average node has `degree` links.
+vector<int> makeRandom(int nodes, double degree) {
+    Random random(42);
+    vector<vector<int>> targets(nodes);
+    for (long i = 0; i < (long)(nodes * degree / 2); ++i) {
+        int from = (int)random.next(nodes), to = (int)random.next(nodes);
+        if (from != to) targets[from].push_back(to);
+    }
+    return toLinks(targets);
+}
+
+// Stochastic block model: nodes are split into `blocks` equal communities.
+// An average node has `inner` links within its community and `outer` links
+// to nodes of other communities.
+vector<int> makeBlocks(int nodes, int blocks, double inner, double outer) {
+    Random random(42);
+    vector<vector<int>> targets(nodes);
+    int blockSize = (nodes + blocks - 1) / blocks;
+    for (long i = 0; i < (long)(nodes * inner / 2); ++i) {
+        int from = (int)random.next(nodes);
+        int first = from / blockSize * blockSize;
+        int to = first + (int)random.next(min(blockSize, nodes - first));
+        if (from != to) targets[from].push_back(to);
+    }
+    for (long i = 0; i < (long)(nodes * outer / 2) && blocks > 1; ++i) {
+        int from = (int)random.next(nodes), to = (int)random.next(nodes);
+        if (from / blockSize != to / blockSize) targets[from].push_back(to);
+        else i -= 1;
+    }
+    return toLinks(targets);
+}
+
+vector<int> readLinks(const char *fileName) {
+    ifstream file(fileName, ios::in | ios::binary | ios::ate);
+    if (!file.is_open()) throw "Could not read links file";
+    streampos size = file.tellg();
+    vector<int> links(size / 4);
+    file.seekg(0, ios::beg);
+    file.read((char *)links.data(), links.size() * 4);
+    return links;
+}
+
+double distance(const Body &a, const Body &b) {
+    double dx = a.pos.x - b.pos.x, dy = a.pos.y - b.pos.y, dz = a.pos.z - b.pos.z;
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+struct Result {
+    double msPerStep;
+    int steps;
+    double edgeMean;   // average length of an edge
+    double edgeSpread; // standard deviation / mean of edge lengths
+    double edgeRatio;  // average edge / average distance of random pairs
+};
+
+// Fills edge statistics of `result` from final positions of the bodies.
+void measure(const vector<int> &links, const vector<Body> &bodies, Result &result) {
+    double sum = 0, squares = 0;
+    size_t edges = 0;
+    int from = 0;
+    for (size_t i = 0; i < links.size(); ++i) {
+        if (links[i] < 0) {
+            from = -links[i] - 1;
+            continue;
+        }
+        double length = distance(bodies[from], bodies[links[i] - 1]);
+        sum += length;
+        squares += length * length;
+        edges += 1;
+    }
+    result.edgeMean = sum / edges;
+    result.edgeSpread = sqrt(max(0.0, squares / edges - result.edgeMean * result.edgeMean)) / result.edgeMean;
+
+    Random random(42);
+    double pairs = 0;
+    const int samples = 100000;
+    for (int i = 0; i < samples; ++i) {
+        pairs += distance(bodies[(size_t)random.next(bodies.size())], bodies[(size_t)random.next(bodies.size())]);
+    }
+    result.edgeRatio = result.edgeMean / (pairs / samples);
+}
+
+template <typename Real, int Dim>
+Result run(vector<int> links, int maxSteps) {
+    Layout<Real, Dim> layout;
+    layout.init(links.data(), links.size());
+
+    Result result;
+    auto start = chrono::steady_clock::now();
+    for (result.steps = 1; result.steps < maxSteps; ++result.steps) {
+        if (layout.step()) break;
+    }
+    auto end = chrono::steady_clock::now();
+    result.msPerStep = chrono::duration<double, milli>(end - start).count() / result.steps;
+
+    measure(links, *layout.getBodies(), result);
+    return result;
+}
+
+void print(const char *name, const Result &result) {
+    cout << setw(10) << name
+    << setw(12) << fixed << setprecision(2) << result.msPerStep
+    << setw(8) << result.steps
+    << setw(12) << setprecision(2) << result.edgeMean
+    << setw(12) << setprecision(4) << result.edgeSpread
+    << setw(12) << setprecision(5) << result.edgeRatio << endl;
+}
+
+// Runs the same steps with 1, 2, 4... threads up to the number of cores.
+// Every run must produce the same positions as the single threaded one.
+int scaling(int nodes, int steps) {
+    vector<int> links = makePowerLaw(nodes, 3);
+    int maxThreads = omp_get_max_threads();
+    vector<Body> reference;
+    double single = 0;
+    bool independent = true;
+
+    cout << setw(8) << "threads" << setw(12) << "ms/step" << setw(10) << "speedup"
+    << setw(10) << "same" << endl;
+    for (int threads = 1; ; threads = min(threads * 2, maxThreads)) {
+        omp_set_num_threads(threads);
+        Layout<> layout;
+        layout.init(links.data(), links.size());
+
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < steps; ++i) layout.step();
+        auto end = chrono::steady_clock::now();
+
+        double ms = chrono::duration<double, milli>(end - start).count() / steps;
+        const vector<Body> &bodies = *layout.getBodies();
+        bool same = true;
+        if (threads == 1) {
+            reference = bodies;
+            single = ms;
+        } else {
+            for (size_t i = 0; i < bodies.size(); ++i) {
+                same = same && bodies[i].pos.x == reference[i].pos.x &&
+                    bodies[i].pos.y == reference[i].pos.y && bodies[i].pos.z == reference[i].pos.z;
+            }
+        }
+        cout << setw(8) << threads << setw(12) << fixed << setprecision(2) << ms
+        << setw(10) << single / ms << setw(10) << (same ? "yes" : "no") << endl;
+        independent = independent && same;
+        if (threads == maxThreads) break;
+    }
+    return independent ? 0 : 1;
+}
+
+// Positions written the way the demo used to: rounded and written body by
+// body, while the layout waits.
+void saveDirectly(const char *fileName, Layout<> &layout) {
+    const vector<Body> &bodies = *layout.getBodies();
+    ofstream file(fileName, ofstream::binary);
+    for (size_t i = 0; i < bodies.size(); ++i) {
+        int triplet[3] = { (int)floor(bodies[i].pos.x + 0.5), (int)floor(bodies[i].pos.y + 0.5),
+            (int)floor(bodies[i].pos.z + 0.5) };
+        file.write((const char *)triplet, sizeof(triplet));
+    }
+}
+
+struct SnapshotResult {
+    double msPerStep;
+    double msPerSave; // time the layout waited for each snapshot
+};
+
+// Saves a snapshot every `every` steps (0 - never), directly (mode 0) or
+// through SnapshotWriter in raw (1) or delta (2) format.
+SnapshotResult snapshotStep(const vector<int> &links, int steps, int every, int mode) {
+    SnapshotWriter writer(mode == 2 ? SnapshotFormat::Delta : SnapshotFormat::Raw);
+    Layout<> layout;
+    layout.init(links.data(), links.size());
+    const char *fileName = "layout-bench-snapshot.bin";
+
+    double saving = 0;
+    int saves = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i) {
+        layout.step();
+        if (every == 0 || i % every != 0) continue;
+        auto saveStart = chrono::steady_clock::now();
+        if (mode == 0) {
+            saveDirectly(fileName, layout);
+        } else {
+            int *positions = writer.acquire(layout.getBodiesCount() * 3);
+            layout.getPositions(positions);
+            writer.submit(fileName);
+        }
+        saving += chrono::duration<double, milli>(chrono::steady_clock::now() - saveStart).count();
+        saves += 1;
+    }
+    auto end = chrono::steady_clock::now();
+    writer.flush();
+    remove(fileName);
+
+    SnapshotResult result;
+    result.msPerStep = chrono::duration<double, milli>(end - start).count() / steps;
+    result.msPerSave = saves > 0 ? saving / saves : 0;
+    return result;
+}
+
+int snapshots(int nodes, int steps) {
+    vector<int> links = makePowerLaw(nodes, 3);
+    const char *modes[] = { "direct", "async", "delta" };
+    cout << setw(8) << "mode" << setw(8) << "every" << setw(12) << "ms/step" << setw(12) << "ms/save" << endl;
+    for (int mode = 0; mode < 3; ++mode) {
+        for (int every : { 0, 5, 1 }) {
+            SnapshotResult result = snapshotStep(links, steps, every, mode);
+            cout << setw(8) << modes[mode] << setw(8) << (every == 0 ? string("never") : to_string(every))
+            << setw(12) << fixed << setprecision(2) << result.msPerStep
+            << setw(12) << result.msPerSave << endl;
+        }
+    }
+    return 0;
+}
+
+// Lays out a power-law graph for `steps` steps, then continues from there
+// with the tree rebuilt on every step and refitted with a few thresholds,
+// all in lockstep so that they share the noise of the machine. `apart` is
+// how far bodies ended up from where the rebuilding layout put them,
+// relative to the average edge. Fails when a refitting layout is slower
+// than the rebuilding one (by more than 5%, the noise of a run), or ends up
+// more than one edge apart.
+int refit(int nodes, int steps) {
+    vector<int> links = makePowerLaw(nodes, 3);
+    vector<int> start(nodes * 3);
+    {
+        Layout<> layout;
+        layout.init(links.data(), links.size());
+        for (int i = 0; i < steps; ++i) layout.step();
+        layout.getPositions(start.data());
+    }
+
+    const double thresholds[] = { -1.0, 0.05, 0.1, 0.2, 0.4 };
+    const int count = sizeof(thresholds) / sizeof(thresholds[0]);
+    vector<Layout<>> layouts(count);
+    vector<double> ms(count, 0);
+    for (int k = 0; k < count; ++k) {
+        layouts[k].getSettings()->treeRefit = thresholds[k] >= 0;
+        layouts[k].getSettings()->refitThreshold = thresholds[k];
+        layouts[k].init(links.data(), links.size(), start.data(), start.size());
+    }
+    for (int i = 0; i < steps; ++i) {
+        for (int k = 0; k < count; ++k) {
+            auto begin = chrono::steady_clock::now();
+            layouts[k].step();
+            ms[k] += chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+        }
+    }
+
+    const vector<Body> reference = *layouts[0].getBodies();
+    double edge = 0;
+    size_t edges = 0;
+    int from = 0;
+    for (size_t i = 0; i < links.size(); ++i) {
+        if (links[i] < 0) {
+            from = -links[i] - 1;
+            continue;
+        }
+        edge += distance(reference[from], reference[links[i] - 1]);
+        edges += 1;
+    }
+    edge /= edges;
+
+    int failed = 0;
+    cout << setw(10) << "threshold" << setw(12) << "ms/step" << setw(10) << "rebuilds"
+    << setw(10) << "refits" << setw(12) << "apart" << endl;
+    for (int k = 0; k < count; ++k) {
+        const vector<Body> &bodies = *layouts[k].getBodies();
+        double apart = 0;
+        for (size_t i = 0; i < bodies.size(); ++i) apart += distance(bodies[i], reference[i]);
+        apart /= bodies.size() * edge;
+        bool ok = ms[k] <= ms[0] * 1.05 && apart <= 1;
+        failed += !ok;
+
+        const TreeStats &stats = layouts[k].getTreeStats();
+        cout << setw(10) << (thresholds[k] < 0 ? string("off") : to_string(thresholds[k]).substr(0, 5))
+        << setw(12) << fixed << setprecision(2) << ms[k] / steps
+        << setw(10) << stats.rebuilds << setw(10) << stats.refits
+        << setw(12) << setprecision(4) << apart << (ok ? "" : "  slower or apart") << endl;
+    }
+
+    // A layout initialized again with a graph of as many bodies must not
+    // refit the tree of the previous graph.
+    vector<int> other = makeRandom(nodes, 6);
+    Layout<> fresh, reused;
+    for (Layout<> *layout : { &fresh, &reused }) {
+        layout->getSettings()->treeRefit = true;
+        layout->getSettings()->refitThreshold = 1.0;
+    }
+    reused.init(links.data(), links.size());
+    for (int i = 0; i < 10; ++i) reused.step();
+    reused.init(other.data(), other.size());
+    fresh.init(other.data(), other.size());
+    for (int i = 0; i < 10; ++i) {
+        fresh.step();
+        reused.step();
+    }
+    const vector<Body> &a = *fresh.getBodies(), &b = *reused.getBodies();
+    bool same = a.size() == b.size();
+    for (size_t i = 0; same && i < a.size(); ++i) {
+        same = a[i].pos.x == b[i].pos.x && a[i].pos.y == b[i].pos.y && a[i].pos.z == b[i].pos.z;
+    }
+    cout << "initialized again: " << (same ? "same" : "DIFFERENT") << " positions as a fresh layout" << endl;
+    return same && failed == 0 ? 0 : 1;
+}
+
+// Lays out a graph from random positions and from a multilevel start.
+// Seconds include init(), so the time spent on coarse levels counts.
+int multilevel(const vector<int> &links, int steps) {
+    cout << setw(12) << "start" << setw(8) << "steps" << setw(10) << "seconds"
+    << setw(12) << "edge/pair" << setw(12) << "spread" << endl;
+    for (bool coarsen : { false, true }) {
+        Layout<> layout;
+        layout.getSettings()->multilevel = coarsen;
+
+        // Measuring quality takes time too, so only init() and step() count.
+        auto start = chrono::steady_clock::now();
+        layout.init(links.data(), links.size());
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for (int i = 0, next = 0; i <= steps; ++i) {
+            if (i == next) {
+                Result result;
+                measure(links, *layout.getBodies(), result);
+                cout << setw(12) << (coarsen ? "multilevel" : "random") << setw(8) << i
+                << setw(10) << fixed << setprecision(2) << seconds
+                << setw(12) << setprecision(5) << result.edgeRatio
+                << setw(12) << setprecision(4) << result.edgeSpread << endl;
+                next = next == 0 ? 25 : next * 2;
+            }
+            if (i == steps) break;
+            start = chrono::steady_clock::now();
+            layout.step();
+            seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+    }
+    return 0;
+}
+
+// Steps each graph until step() reports it stable (or `maxSteps`), with
+// the velocity and the adaptive integrator. The default stableThreshold
+// is below the jitter of Barnes-Hut forces on these graphs, so it is
+// given here.
+int integrators(double threshold, int maxSteps) {
+    const char *names[] = { "grid", "power-law" };
+    vector<int> graphs[] = { makeGrid(16), makePowerLaw(5000, 3) };
+    cout << setw(10) << "graph" << setw(10) << "method" << setw(8) << "steps"
+    << setw(10) << "seconds" << setw(12) << "edge/pair" << setw(12) << "spread" << endl;
+    for (int g = 0; g < 2; ++g) {
+        for (Integrator integrator : { Integrator::Velocity, Integrator::Adaptive }) {
+            Layout<> layout;
+            layout.getSettings()->integrator = integrator;
+            layout.getSettings()->stableThreshold = threshold;
+            layout.init(graphs[g].data(), graphs[g].size());
+
+            Result result;
+            bool stable = false;
+            auto start = chrono::steady_clock::now();
+            for (result.steps = 0; result.steps < maxSteps && !stable; ++result.steps) {
+                stable = layout.step();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            measure(graphs[g], *layout.getBodies(), result);
+            cout << setw(10) << names[g] << setw(10) << (integrator == Integrator::Adaptive ? "adaptive" : "velocity")
+            << setw(8) << (stable ? to_string(result.steps) : string("-"))
+            << setw(10) << fixed << setprecision(2) << seconds
+            << setw(12) << setprecision(5) << result.edgeRatio
+            << setw(12) << setprecision(4) << result.edgeSpread << endl;
+        }
+    }
+    return 0;
+}
+
+// Time per step of a power-law graph on 1, 2, 4... threads, with and
+// without LayoutSettings::numa. Pinned threads stay pinned, so all runs
+// without it go first. Past one socket, the NUMA runs should keep scaling.
+int numa(int nodes, int steps) {
+    vector<int> links = makePowerLaw(nodes, 3);
+    int maxThreads = omp_get_max_threads();
+    vector<int> threadCounts;
+    for (int threads = 1; ; threads = min(threads * 2, maxThreads)) {
+        threadCounts.push_back(threads);
+        if (threads == maxThreads) break;
+    }
+
+    vector<double> ms[2];
+    for (int mode = 0; mode < 2; ++mode) {
+        for (size_t t = 0; t < threadCounts.size(); ++t) {
+            omp_set_num_threads(threadCounts[t]);
+            Layout<> layout;
+            layout.getSettings()->numa = mode == 1;
+            layout.init(links.data(), links.size());
+
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < steps; ++i) layout.step();
+            auto end = chrono::steady_clock::now();
+            ms[mode].push_back(chrono::duration<double, milli>(end - start).count() / steps);
+        }
+    }
+
+    cout << setw(8) << "threads" << setw(12) << "ms/step" << setw(10) << "speedup"
+    << setw(12) << "numa ms" << setw(10) << "speedup" << endl;
+    for (size_t t = 0; t < threadCounts.size(); ++t) {
+        cout << setw(8) << threadCounts[t] << setw(12) << fixed << setprecision(2) << ms[0][t]
+        << setw(10) << ms[0][0] / ms[0][t] << setw(12) << ms[1][t] << setw(10) << ms[1][0] / ms[1][t] << endl;
+    }
+    omp_set_num_threads(maxThreads);
+    return 0;
+}
+
+// Runs `steps` steps of every generated graph of about `nodes` nodes on 1,
+// 2, 4... threads, and prints average milliseconds per step of every phase
+// as CSV, with the tree size and interactions per body of the last step.
+int suite(int nodes, int steps) {
+    int side = (int)round(cbrt(nodes));
+    const char *names[] = { "grid", "erdos-renyi", "barabasi-albert", "blocks" };
+    vector<int> graphs[] = { makeGrid(side), makeRandom(nodes, 6), makePowerLaw(nodes, 3),
+        makeBlocks(nodes, 20, 5, 1) };
+    int maxThreads = omp_get_max_threads();
+
+    cout << "graph,nodes,links,threads,steps,tree_ms,repulsion_ms,springs_ms,integrate_ms,step_ms,"
+    << "tree_nodes,tree_depth,interactions" << endl;
+    for (int g = 0; g < 4; ++g) {
+        const vector<int> &links = graphs[g];
+        for (int threads = 1; ; threads = min(threads * 2, maxThreads)) {
+            omp_set_num_threads(threads);
+            Layout<> layout;
+            layout.init(links.data(), links.size());
+            StepMetrics last;
+            layout.setMetricsCallback([&last](const StepMetrics &metrics) { last = metrics; });
+
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < steps; ++i) layout.step();
+            auto end = chrono::steady_clock::now();
+
+            const StepTimings &timings = layout.getTimings();
+            size_t bodies = layout.getBodiesCount();
+            cout << names[g] << ',' << bodies << ',' << links.size() - bodies << ',' << threads << ','
+            << steps << ',' << fixed << setprecision(3) << timings.tree / steps << ','
+            << timings.repulsion / steps << ',' << timings.springs / steps << ','
+            << timings.integrate / steps << ','
+            << chrono::duration<double, milli>(end - start).count() / steps << ','
+            << last.treeNodes << ',' << last.treeDepth << ',' << setprecision(1) << last.interactionsPerBody << endl;
+            if (threads == maxThreads) break;
+        }
+    }
+    omp_set_num_threads(maxThreads);
+    return 0;
+}
+
+// Bodies at rounded positions, for measure().
+vector<Body> toBodies(const vector<int> &positions) {
+    vector<Body> bodies(positions.size() / 3);
+    for (size_t i = 0; i < bodies.size(); ++i) {
+        bodies[i].setPos(Vector3(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]));
+    }
+    return bodies;
+}
+
+template <typename LayoutType>
+double stepSharded(LayoutType &layout, int steps) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i) layout.step();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count() / steps;
+}
+
+// Runs a power-law graph from the same positions with Layout, with one
+// ShardedLayout shard, which must give the same positions, and with
+// `shards` processes. Workers are forked first: the OpenMP runtime does not
+// survive fork() once it has started threads.
+int sharded(int nodes, int steps, int shards) {
+    vector<int> links = makePowerLaw(nodes, 3);
+    SocketTransport transport(shards);
+    bool main = transport.rank() == 0;
+
+    // Shard 0 runs Layout and a single shard while the workers wait for the
+    // positions to start from.
+    vector<int> start, reference, single;
+    Result results[3];
+    if (main) {
+        Layout<> layout;
+        layout.init(links.data(), links.size());
+        start.resize(layout.getBodiesCount() * 3);
+        layout.getPositions(start.data());
+
+        Layout<> fromStart;
+        fromStart.init(links.data(), links.size(), start.data(), start.size());
+        results[0].msPerStep = stepSharded(fromStart, steps);
+        reference.resize(start.size());
+        fromStart.getPositions(reference.data());
+
+        SocketTransport alone(1);
+        ShardedLayout<> one(alone);
+        one.init(links.data(), links.size(), start.data(), start.size());
+        results[1].msPerStep = stepSharded(one, steps);
+        single.resize(start.size());
+        one.getPositions(single.data());
+    }
+
+    vector<vector<char>> outgoing(shards), incoming;
+    for (int shard = 0; main && shard < shards; ++shard) {
+        MessageWriter(outgoing[shard]).put(start.data(), start.size());
+    }
+    transport.exchange(outgoing, incoming);
+    start.resize(incoming[0].size() / sizeof(int));
+    MessageReader(incoming[0]).get(start.data(), start.size());
+
+    ShardedLayout<> layout(transport);
+    layout.init(links.data(), links.size(), start.data(), start.size());
+    results[2].msPerStep = stepSharded(layout, steps);
+    vector<int> spread(start.size());
+    layout.getPositions(main ? spread.data() : NULL);
+    if (!main) return 0;
+
+    measure(links, toBodies(reference), results[0]);
+    measure(links, toBodies(single), results[1]);
+    measure(links, toBodies(spread), results[2]);
+    cout << setw(10) << "layout" << setw(12) << "ms/step" << setw(8) << "steps"
+    << setw(12) << "edge" << setw(12) << "spread" << setw(12) << "edge/pair" << endl;
+    const char *names[] = { "Layout", "1 shard", "shards" };
+    for (int r = 0; r < 3; ++r) {
+        results[r].steps = steps;
+        print(names[r], results[r]);
+    }
+    cout << "1 shard matches Layout: " << (single == reference ? "yes" : "NO") << endl;
+    return single == reference ? 0 : 1;
+}
+
+// Lays out `count` graphs of 100 to 10000 nodes (log-uniform, in steps of
+// ten, every other one power-law, the rest Erdos-Renyi) for up to `steps`
+// steps, one Layout after another and with BatchLayout, and prints graphs
+// per second. Runs again with treeRefit: many graphs have as many bodies as
+// the one a batch layout had before, and must not refit its tree.
+int batch(int count, int steps) {
+    Random random(7);
+    vector<vector<int>> corpus(count);
+    vector<BatchGraph> graphs(count);
+    size_t bodies = 0;
+    for (int g = 0; g < count; ++g) {
+        int nodes = 10 * (int)(10 * pow(100, random.nextDouble()));
+        corpus[g] = g % 2 == 0 ? makePowerLaw(nodes, 3) : makeRandom(nodes, 4);
+        graphs[g].links = corpus[g].data();
+        graphs[g].size = corpus[g].size();
+        bodies += nodes;
+    }
+
+    cout << count << " graphs, " << bodies << " bodies, " << omp_get_max_threads() << " threads" << endl;
+    int failed = 0;
+    for (bool treeRefit : { false, true }) {
+        auto start = chrono::steady_clock::now();
+        vector<vector<int>> separate(count);
+        for (int g = 0; g < count; ++g) {
+            Layout<> layout;
+            layout.getSettings()->treeRefit = treeRefit;
+            layout.init(graphs[g].links, graphs[g].size);
+            for (int i = 0; i < steps; ++i) {
+                if (layout.step()) break;
+            }
+            separate[g].resize(layout.getBodiesCount() * 3);
+            layout.getPositions(separate[g].data());
+        }
+        double separateSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        BatchLayout<> layout;
+        layout.getSettings()->treeRefit = treeRefit;
+        vector<BatchResult> results;
+        layout.run(graphs, steps, results);
+        double batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        int same = 0;
+        for (int g = 0; g < count; ++g) same += !results[g].error && results[g].positions == separate[g];
+        failed += count - same;
+        cout << "treeRefit " << (treeRefit ? "on" : "off") << endl
+        << setw(10) << "Layout" << setw(12) << fixed << setprecision(1) << count / separateSeconds << " graphs/s" << endl
+        << setw(10) << "batch" << setw(12) << count / batchSeconds << " graphs/s" << endl
+        << same << " of " << count << " graphs have the same positions" << endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+// Movement of the next step of `layout`.
+double nextMovement(Layout<> &layout) {
+    double movement = 0;
+    layout.setMetricsCallback([&movement](const StepMetrics &metrics) { movement = metrics.movement; });
+    layout.step();
+    layout.setMetricsCallback(nullptr);
+    return movement;
+}
+
+// Runs a power-law graph for `steps` steps and saves a checkpoint. Then
+// times resuming from it and from rounded positions, and compares the next
+// `steps` steps with those of the layout that kept going.
+int checkpoint(int nodes, int steps) {
+    vector<int> links = makePowerLaw(nodes, 3);
+    const char *fileName = "bench.ckpt";
+    Layout<> layout;
+    layout.init(links.data(), links.size());
+    for (int i = 0; i < steps; ++i) layout.step();
+
+    auto start = chrono::steady_clock::now();
+    layout.saveCheckpoint(fileName);
+    double saveMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    vector<int> positions(layout.getBodiesCount() * 3);
+    layout.getPositions(positions.data());
+
+    start = chrono::steady_clock::now();
+    Layout<> resumed;
+    resumed.resume(links.data(), links.size(), fileName);
+    double resumeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    Layout<> restarted;
+    restarted.init(links.data(), links.size(), positions.data(), positions.size());
+    double restartMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    double movement[3] = { nextMovement(layout), nextMovement(resumed), nextMovement(restarted) };
+    for (int i = 1; i < steps; ++i) {
+        layout.step();
+        resumed.step();
+    }
+    vector<int> kept(positions.size()), fromCheckpoint(positions.size());
+    layout.getPositions(kept.data());
+    resumed.getPositions(fromCheckpoint.data());
+    remove(fileName);
+
+    cout << layout.getBodiesCount() << " bodies" << endl << fixed << setprecision(1)
+    << "save checkpoint     " << setw(10) << saveMs << " ms" << endl
+    << "resume checkpoint   " << setw(10) << resumeMs << " ms" << endl
+    << "init with positions " << setw(10) << restartMs << " ms" << endl
+    << "movement of the next step: kept going " << movement[0] << ", checkpoint " << movement[1]
+    << ", positions " << movement[2] << endl
+    << "checkpoint continues exactly: " << (kept == fromCheckpoint ? "yes" : "NO") << endl;
+    return kept == fromCheckpoint ? 0 : 1;
+}
+
+// Compares Multipole forces on `count` random bodies with the exact O(n^2)
+// sum, for expansion orders 2, 4 and 6 (3D, double), and fails when the
+// relative error of a body's force is too large: the median above about
+// twice what these orders give, or the largest one (a few bodies next to a
+// cell boundary, growing with the count) above a looser bound.
+int fmmAccuracy(int count) {
+    LayoutSettings settings;
+    BodyStore<double, 3> bodies;
+    bodies.resize(count);
+    Random random(7);
+    for (int i = 0; i < count; ++i) {
+        for (int axis = 0; axis < 3; ++axis) bodies.pos[axis][i] = random.next(1000);
+        bodies.mass[i] = 1 + random.next(3);
+    }
+
+    // The exact force, as QuadTree sums the bodies of nearby leaves.
+    const ForceKernels<double, 3> &kernels = scalarKernels<double, 3>();
+    const double *position[3] = { bodies.pos[0].data(), bodies.pos[1].data(), bodies.pos[2].data() };
+    vector<double> exact[3];
+    for (int axis = 0; axis < 3; ++axis) exact[axis].resize(count);
+    #pragma omp parallel for
+    for (int i = 0; i < count; ++i) {
+        double point[3] = { bodies.pos[0][i], bodies.pos[1][i], bodies.pos[2][i] };
+        double force[3] = {};
+        kernels.repulsion(position, bodies.mass.data(), count, point, force);
+        for (int axis = 0; axis < 3; ++axis) exact[axis][i] = settings.gravity * bodies.mass[i] * force[axis];
+    }
+
+    struct Case { int order; double median, max; };
+    int failed = 0;
+    cout << count << " bodies" << endl << setw(8) << "order" << setw(12) << "median" << setw(12) << "max" << endl;
+    for (Case c : { Case{ 2, 1e-2, 0.5 }, Case{ 4, 2e-3, 0.1 }, Case{ 6, 4e-4, 0.05 } }) {
+        settings.multipoleOrder = c.order;
+        QuadTree<double, 3> tree(settings);
+        Multipole<double, 3> multipole(settings);
+        tree.insertBodies(bodies, 0);
+        multipole.updateForces(tree, bodies);
+
+        vector<double> errors(count);
+        for (int i = 0; i < count; ++i) {
+            double difference = 0, length = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                double d = bodies.force[axis][i] - exact[axis][i];
+                difference += d * d;
+                length += exact[axis][i] * exact[axis][i];
+            }
+            errors[i] = sqrt(difference / length);
+        }
+        sort(errors.begin(), errors.end());
+        double median = errors[count / 2], max = errors.back();
+        bool ok = median <= c.median && max <= c.max;
+        failed += !ok;
+        cout << setw(8) << c.order << setw(12) << scientific << setprecision(2) << median
+        << setw(12) << max << (ok ? "" : "  above bound") << endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+// Relative difference of two forces, 0 when both are zero.
+template <int Dim>
+double forceError(const double *expected, const double *actual) {
+    double difference = 0, length = 0;
+    for (int axis = 0; axis < Dim; ++axis) {
+        difference += (actual[axis] - expected[axis]) * (actual[axis] - expected[axis]);
+        length += expected[axis] * expected[axis];
+    }
+    if (difference == 0) return 0;
+    return length > 0 ? sqrt(difference / length) : INFINITY;
+}
+
+// Runs scalarKernels() and selectKernels() on the same random inputs of 0 to
+// 2 x width + 1 interactions, so that every masked tail is hit. The point is
+// one of the interacting positions, so the zero-distance pair is in every
+// non-empty input. Returns the largest relative difference.
+template <typename Real, int Dim>
+double kernelError() {
+    const ForceKernels<Real, Dim> &scalar = scalarKernels<Real, Dim>(), &selected = selectKernels<Real, Dim>();
+    Random random(11);
+    double worst = 0;
+    for (size_t count = 0; count <= 2 * selected.width + 1; ++count) {
+        for (int trial = 0; trial < 20; ++trial) {
+            vector<Real> pos[Dim], mass(count);
+            const Real *position[Dim];
+            for (int axis = 0; axis < Dim; ++axis) {
+                pos[axis].resize(count);
+                for (size_t k = 0; k < count; ++k) pos[axis][k] = (Real)random.next(100);
+                position[axis] = pos[axis].data();
+            }
+            for (size_t k = 0; k < count; ++k) mass[k] = (Real)(1 + random.next(3));
+            Real point[Dim];
+            for (int axis = 0; axis < Dim; ++axis) point[axis] = count > 0 ? pos[axis][count / 2] : 50;
+
+            double expected[Dim] = {}, actual[Dim] = {};
+            scalar.repulsion(position, mass.data(), count, point, expected);
+            selected.repulsion(position, mass.data(), count, point, actual);
+            worst = max(worst, forceError<Dim>(expected, actual));
+
+            double expectedPull[Dim] = {}, actualPull[Dim] = {};
+            scalar.springs(position, count, point, 30, (Real)0.0008, expectedPull);
+            selected.springs(position, count, point, 30, (Real)0.0008, actualPull);
+            worst = max(worst, forceError<Dim>(expectedPull, actualPull));
+        }
+    }
+    // NaN compares false with everything, see to it that it fails.
+    return worst == worst ? worst : INFINITY;
+}
+
+// Compares the kernels this CPU runs (see NGRAPH_KERNELS) with the scalar
+// ones, for float and double in 3D and 2D.
+int kernels() {
+    double errors[] = { kernelError<float, 3>(), kernelError<float, 2>(),
+                        kernelError<double, 3>(), kernelError<double, 2>() };
+    const char *names[] = { "float", "float 2D", "double", "double 2D" };
+    const char *selected[] = { selectKernels<float, 3>().name, selectKernels<float, 2>().name,
+                               selectKernels<double, 3>().name, selectKernels<double, 2>().name };
+    int failed = 0;
+    cout << setw(10) << "type" << setw(10) << "kernels" << setw(12) << "error" << endl;
+    for (int i = 0; i < 4; ++i) {
+        double bound = i < 2 ? 1e-5 : 1e-13;
+        bool ok = errors[i] <= bound;
+        failed += !ok;
+        cout << setw(10) << names[i] << setw(10) << selected[i] << setw(12) << scientific << setprecision(2)
+        << errors[i] << (ok ? "" : "  above bound") << endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc > 1 && string(argv[1]) == "--help") {
+        cout << "Usage: " << endl
+        << "  layout-bench [links.bin] [steps]" << endl
+        << "Runs the same layout in float and double precision, in 3D and 2D. Without" << endl
+        << "`links.bin` a 32 x 32 x 32 grid is used; `steps` is 500 by default." << endl
+        << "  layout-bench --suite [nodes] [steps]" << endl
+        << "Runs `steps` (20) steps of a grid, an Erdos-Renyi, a Barabasi-Albert and a" << endl
+        << "stochastic block model graph of about `nodes` (100000) nodes on 1, 2, 4..." << endl
+        << "threads, and prints milliseconds per step of every phase as CSV." << endl
+        << "  layout-bench --numa [nodes] [steps]" << endl
+        << "Runs `steps` (50) steps of a power-law graph with `nodes` (1000000) nodes on" << endl
+        << "1, 2, 4... threads, without and with NUMA placement." << endl
+        << "  layout-bench --scaling [nodes] [steps]" << endl
+        << "Runs `steps` (100) steps of a power-law graph with `nodes` (200000) nodes" << endl
+        << "on 1, 2, 4... threads." << endl
+        << "  layout-bench --snapshots [nodes] [steps]" << endl
+        << "Runs a power-law graph with `nodes` (100000) nodes for `steps` (30) steps," << endl
+        << "saving positions every 5th or every step, directly or in background." << endl
+        << "  layout-bench --refit [nodes] [steps]" << endl
+        << "Runs a power-law graph with `nodes` (100000) nodes for `steps` (200) steps," << endl
+        << "then as many steps rebuilding the tree or refitting it; fails if refitting is slower." << endl
+        << "  layout-bench --multilevel [links.bin] [steps]" << endl
+        << "Lays out the graph (the 32 x 32 x 32 grid) for up to `steps` (800) steps," << endl
+        << "from random positions and from a multilevel start." << endl
+        << "  layout-bench --integrators [threshold] [steps]" << endl
+        << "Counts steps until a grid and a power-law graph are stable (movement below" << endl
+        << "`threshold`, 20), with either integrator, giving up after `steps` (5000)." << endl
+        << "  layout-bench --sharded [nodes] [steps] [shards]" << endl
+        << "Runs `steps` (100) steps of a power-law graph with `nodes` (100000) nodes" << endl
+        << "with Layout, one shard and `shards` (4) processes of ShardedLayout." << endl
+        << "  layout-bench --batch [graphs] [steps]" << endl
+        << "Lays out `graphs` (1000) graphs of 100 to 10000 nodes for up to `steps`" << endl
+        << "(200) steps, with a Layout per graph and with BatchLayout." << endl
+        << "  layout-bench --checkpoint [nodes] [steps]" << endl
+        << "Saves a power-law graph of `nodes` (1000000) nodes after `steps` (20)" << endl
+        << "steps, and times resuming from the checkpoint and from positions." << endl
+        << "  layout-bench --fmm-accuracy [bodies]" << endl
+        << "Compares Multipole forces on `bodies` (10000) random bodies with the exact" << endl
+        << "sum, for expansion orders 2, 4 and 6." << endl
+        << "  layout-bench --kernels" << endl
+        << "Compares the force kernels this CPU runs (NGRAPH_KERNELS picks a narrower" << endl
+        << "set) with the scalar ones." << endl;
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--kernels") {
+        return kernels();
+    }
+    if (argc > 1 && string(argv[1]) == "--fmm-accuracy") {
+        return fmmAccuracy(argc > 2 ? atoi(argv[2]) : 10000);
+    }
+    if (argc > 1 && string(argv[1]) == "--checkpoint") {
+        return checkpoint(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 20);
+    }
+    if (argc > 1 && string(argv[1]) == "--batch") {
+        return batch(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 200);
+    }
+    if (argc > 1 && string(argv[1]) == "--sharded") {
+        return sharded(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 100,
+                       argc > 4 ? atoi(argv[4]) : 4);
+    }
+    if (argc > 1 && string(argv[1]) == "--snapshots") {
+        return snapshots(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 30);
+    }
+    if (argc > 1 && string(argv[1]) == "--numa") {
+        return numa(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 50);
+    }
+    if (argc > 1 && string(argv[1]) == "--suite") {
+        return suite(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 20);
+    }
+    if (argc > 1 && string(argv[1]) == "--integrators") {
+        return integrators(argc > 2 ? atof(argv[2]) : 20, argc > 3 ? atoi(argv[3]) : 5000);
+    }
+    if (argc > 1 && string(argv[1]) == "--multilevel") {
+        return multilevel(argc > 2 ? readLinks(argv[2]) : makeGrid(32), argc > 3 ? atoi(argv[3]) : 800);
+    }
+    if (argc > 1 && string(argv[1]) == "--refit") {
+        return refit(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 200);
+    }
+    if (argc > 1 && string(argv[1]) == "--scaling") {
+        return scaling(argc > 2 ? atoi(argv[2]) : 200000, argc > 3 ? atoi(argv[3]) : 100);
+    }
+
+    vector<int> links = argc > 1 ? readLinks(argv[1]) : makeGrid(32);
+    int steps = argc > 2 ? atoi(argv[2]) : 500;
+
+    Result single = run<float, 3>(links, steps);
+    Result full = run<double, 3>(links, steps);
+    Result single2D = run<float, 2>(links, steps);
+    Result full2D = run<double, 2>(links, steps);
+
+    cout << setw(10) << "type" << setw(12) << "ms/step" << setw(8) << "steps"
+    << setw(12) << "edge" << setw(12) << "spread" << setw(12) << "edge/pair" << endl;
+    print("float", single);
+    print("double", full);
+    print("float 2D", single2D);
+    print("double 2D", full2D);
+    return 0;
+}
@@ -7,58 +7,29 @@
 #include <unistd.h>
 
 #include "layout.h"
+#include "sharded.h"
+#include "mappedFile.h"
+#include "snapshot.h"
 
 using namespace std;
 
-void save(int i, std::vector<Body> *bodies) {
+// Rounded positions are copied into a snapshot buffer, and the file is
+// written in background while the layout keeps going.
+template <typename LayoutType>
+void save(int i, LayoutType &layout, SnapshotWriter &snapshots, const char *extension) {
     std::stringstream ss;
+    ss << i << extension;
 
-    ss << i << ".bin";
-    std::ofstream outfile (ss.str(), std::ofstream::binary);
-
-    char block[3 * 4];
-    int *triplet = (int *)&block;
-    for (vector<Body>::iterator body = bodies->begin() ; body != bodies->end(); ++body) {
-        triplet[0] = floor(body->pos.x + 0.5);
-        triplet[1] = floor(body->pos.y + 0.5);
-        triplet[2] = floor(body->pos.z + 0.5);
-        //    cout << triplet[0] << "," << triplet[1] << "," << triplet[2] << " <- node" << endl;
-        outfile.write(block, 3 * 4);
-    }
-    outfile.close();
-}
-
-typedef struct {
-    int *content;
-    long size;
-} FileContent;
-
-FileContent* readFile(const char *fileName) {
-    streampos size;
-    char * memblock;
-    ifstream file (fileName, ios::in|ios::binary|ios::ate);
-
-    if (file.is_open())
-    {
-        size = file.tellg();
-        memblock = new char [size];
-        file.seekg(0, ios::beg);
-        file.read(memblock, size);
-        file.close();
-        FileContent *result = new FileContent();
-        result->size = size/4;
-        result->content = (int *) memblock;
-        return result;
-    } else {
-        return nullptr;
-    }
+    int *positions = snapshots.acquire(layout.getBodiesCount() * 3);
+    layout.getPositions(positions);
+    snapshots.submit(ss.str());
 }
 
 int getIterationNumberFromPositionFileName(const char *positionFileName) {
     cmatch match;
-    regex pattern(".*?(\\d+)\\.bin$");
+    regex pattern(".*?(\\d+)\\.(bin|ckpt)$");
     regex_match(positionFileName, match, pattern);
-    if (match.size() == 2) {
+    if (match.size() == 3) {
         try {
             return stoi(match[1]) + 1;
         }
@@ -69,16 +40,83 @@ int getIterationNumberFromPositionFileName(const char *positionFileName) {
     return 0;
 }
 
+// Runs the layout in `shards` processes of this machine, see ShardedLayout.
+// Only the first one prints progress and writes snapshots.
+int runSharded(int shards, const MappedFile &graphFile, const char *posFileName, bool delta) {
+    SocketTransport transport(shards);
+    bool main = transport.rank() == 0;
+    ShardedLayout<> graphLayout(transport);
+    int startFrom = 0;
+    if (posFileName == NULL) {
+        graphLayout.init(graphFile.data(), graphFile.size());
+    } else {
+        startFrom = getIterationNumberFromPositionFileName(posFileName);
+        MappedFile positions(posFileName);
+        graphLayout.init(graphFile.data(), graphFile.size(), positions.data(), positions.size());
+    }
+    if (main) {
+        cout << "Loaded " << graphLayout.getBodiesCount() << " bodies into " << shards << " shards;" << endl;
+        cout << "Starting layout from " << startFrom << " iteration;" << endl;
+    }
+
+    SnapshotWriter snapshots(delta ? SnapshotFormat::Delta : SnapshotFormat::Raw);
+    const char *extension = delta ? ".delta" : ".bin";
+
+    for (int i = startFrom; i < 10000; ++i) {
+        if (main) cout << "Step " << i << endl;
+        bool done = graphLayout.step();
+        if (done) {
+            if (main) cout << "Done!" << endl;
+            break;
+        }
+        if (i % 5 == 0) {
+            if (main) {
+                save(i, graphLayout, snapshots, extension);
+            } else {
+                graphLayout.getPositions(NULL);
+            }
+        }
+    }
+    return 0;
+}
+
 int main(int argc, const char * argv[]) {
+    // --delta writes compressed snapshots (see SnapshotFormat::Delta).
+    // --multilevel starts from a layout of a coarsened graph.
+    // --shards N splits the layout between N processes.
+    // --checkpoint saves the whole state of the layout every 100 steps.
+    bool delta = false, multilevel = false, checkpoint = false;
+    int shards = 1;
+    for (; argc > 1; argc -= 1) {
+        string flag = argv[argc - 1];
+        if (flag == "--delta") delta = true;
+        else if (flag == "--multilevel") multilevel = true;
+        else if (flag == "--checkpoint") checkpoint = true;
+        else if (argc > 2 && string(argv[argc - 2]) == "--shards") {
+            shards = atoi(flag.c_str());
+            argc -= 1;
+        }
+        else break;
+    }
+
     if (argc < 2) {
         cout << "Usage: " << endl
-        << "  layout++ links.bin [positions.bin]" << endl
+        << "  layout++ links.bin [positions.bin] [--delta] [--multilevel] [--checkpoint] [--shards N]" << endl
         << "Where" << endl
         << " `links.bin` is a path to the serialized graph. See " << endl
         << "    https://github.com/anvaka/ngraph.tobinary for format description" << endl
         << "  `positions.bin` is optional file with previously saved positions. " << endl
         << "    This file should match `links.bin` graph, otherwise bad things " << endl
-        << "    will happen" << endl;
+        << "    will happen. A `.ckpt` file continues a layout saved with" << endl
+        << "    `--checkpoint`." << endl
+        << "  `--delta` saves snapshots as N.delta files: differences from the" << endl
+        << "    previous snapshot, every 20th one is complete." << endl
+        << "  `--multilevel` places bodies by laying out ever coarser versions of" << endl
+        << "    the graph first. Ignored when `positions.bin` is given." << endl
+        << "  `--checkpoint` saves the whole state of the layout as N.ckpt every" << endl
+        << "    100 steps, replacing the previous one." << endl
+        << "  `--shards N` runs the layout in N processes, each owning one region" << endl
+        << "    of space. `--multilevel`, `--checkpoint` and weights.bin are not supported." << endl;
         return -1;
     }
 
@@ -93,41 +131,53 @@ int main(int argc, const char * argv[]) {
     }
 
     cout << "Loading links from " << graphFileName << "... " << endl;
-    FileContent *graphFilePtr = readFile(graphFileName);
-    if (graphFilePtr == nullptr) {
-        throw "Could not read links file";
+    // Links are mapped rather than read: the layout scans them in place.
+    MappedFile graphFile(graphFileName);
+    if (shards > 1) {
+        return runSharded(shards, graphFile, argc < 3 ? NULL : argv[2], delta);
     }
-    FileContent graphFile = *graphFilePtr;
 
-    Layout graphLayout;
+    Layout<> graphLayout;
+    graphLayout.getSettings()->multilevel = multilevel;
     int startFrom = 0;
     if (argc < 3) {
-        graphLayout.init(graphFile.content, graphFile.size);
+        graphLayout.init(graphFile.data(), graphFile.size());
         cout << "Done. " << endl;
         cout << "Loaded " << graphLayout.getBodiesCount() << " bodies;" << endl;
     } else {
         const char * posFileName = argv[2];
         startFrom = getIterationNumberFromPositionFileName(posFileName);
-        cout << "Loading positions from " << posFileName << "... ";
-        FileContent *positions = readFile(posFileName);
-        if (positions == nullptr) throw "Positions file could not be read";
-
-        cout << "Done." << endl;
-        graphLayout.init(graphFile.content, graphFile.size, positions->content, positions->size);
+        if (regex_match(posFileName, regex(".*\\.ckpt$"))) {
+            cout << "Resuming from " << posFileName << "... ";
+            graphLayout.resume(graphFile.data(), graphFile.size(), posFileName);
+            cout << "Done." << endl;
+        } else {
+            cout << "Loading positions from " << posFileName << "... ";
+            MappedFile positions(posFileName);
+
+            cout << "Done." << endl;
+            graphLayout.init(graphFile.data(), graphFile.size(), positions.data(), positions.size());
+        }
         cout << "Loaded " << graphLayout.getBodiesCount() << " bodies;" << endl;
     }
     // TODO: This should be done via arguments, but doing it inline now:
     // If current folder containsfil 'weights.bin' we will try to assign
     // nodes weights from this file
-    FileContent *weights = readFile("weights.bin");
-    if (weights != nullptr) {
+    if (access("weights.bin", R_OK) == 0) {
+        MappedFile weights("weights.bin");
         cout << "Detected weights.bin file in the current folder." << endl;
         cout << "Assuming each node has assigned body weight. Reading weights..." << endl;
-        cout << "Size: " << weights->size;
-        graphLayout.setBodiesWeight(weights->content);
+        cout << "Size: " << weights.size();
+        graphLayout.setBodiesWeight(weights.data());
     }
 
     cout << "Starting layout from " << startFrom << " iteration;" << endl;
+    graphLayout.setMetricsCallback([](const StepMetrics &metrics) {
+        cout << metrics.movement << " move" << endl;
+    });
+
+    SnapshotWriter snapshots(delta ? SnapshotFormat::Delta : SnapshotFormat::Raw);
+    const char *extension = delta ? ".delta" : ".bin";
 
     for (int i = startFrom; i < 10000; ++i) {
         cout << "Step " << i << endl;
@@ -137,9 +187,17 @@ int main(int argc, const char * argv[]) {
             break;
         }
         if (i % 5 == 0) {
-            save(i, graphLayout.getBodies());
+            save(i, graphLayout, snapshots, extension);
+        }
+        if (checkpoint && i % 100 == 0) {
+            std::stringstream ss;
+            ss << i << ".ckpt";
+            graphLayout.saveCheckpoint(ss.str().c_str());
+            if (i >= 100) {
+                ss.str("");
+                ss << i - 100 << ".ckpt";
+                remove(ss.str().c_str());
+            }
         }
     }
-
-    delete[] graphFile.content;
 }
@@ -10,6 +10,7 @@
 #define layout___Random_h
 
 #include <cstdlib>
+#include <cstdint>
 #include <chrono>
 
 using namespace std::chrono;
@@ -40,4 +41,40 @@ public:
   }
   
 };
+
+// Call sites that draw from CounterRandom. Each one gets its own stream, so
+// two call sites never see the same numbers for the same body and step.
+enum RandomStream : uint64_t {
+  InitialPositionStream = 1,
+  NeighbourPositionStream = 2,
+  DuplicateStream = 3,
+  MultilevelStream = 4
+};
+
+// Stateless counter-based generator. A number is a hash of its key (seed,
+// stream, body, step, index) rather than the next state of a sequence, so
+// threads share nothing and results do not depend on the order in which
+// numbers are drawn. The mixing function is splitmix64's finalizer.
+class CounterRandom {
+  uint64_t key;
+
+  static uint64_t mix(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+public:
+  CounterRandom(uint64_t seed, RandomStream stream) : key(mix(mix(seed) ^ stream)) {
+  }
+
+  uint64_t nextInt(uint64_t body, uint64_t step, uint64_t index) const {
+    return mix(mix(mix(key ^ body) ^ step) ^ index);
+  }
+
+  // Uniform in [0, 1).
+  double nextDouble(uint64_t body, uint64_t step, uint64_t index) const {
+    return (nextInt(body, step, index) >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
 #endif
@@ -0,0 +1,65 @@
+//
+//  batch.cpp
+//  layout++
+//
+
+#include "batch.h"
+#include <algorithm>
+#include <utility>
+#include <new>
+#include <omp.h>
+
+template <typename Real, int Dim>
+void BatchLayout<Real, Dim>::run(const vector<BatchGraph> &graphs, size_t maxSteps, vector<BatchResult> &results) {
+  results.resize(graphs.size());
+  size_t threads = omp_get_max_threads();
+  if (pool.size() < threads) pool.resize(threads);
+
+  // Longest first: a big graph started last would keep one thread busy
+  // while all others wait.
+  vector<pair<long, size_t>> order(graphs.size());
+  for (size_t g = 0; g < graphs.size(); ++g) order[g] = make_pair(-graphs[g].size, g);
+  sort(order.begin(), order.end());
+
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t k = 0; k < order.size(); ++k) {
+    // Parallel loops of the layout run on this thread alone, even where
+    // nested parallelism is enabled.
+    omp_set_num_threads(1);
+    unique_ptr<Layout<Real, Dim>> &layout = pool[omp_get_thread_num()];
+    const BatchGraph &graph = graphs[order[k].second];
+    BatchResult &result = results[order[k].second];
+
+    // An exception must not leave the parallel loop: that terminates the
+    // program. A layout that threw may be half initialized, and is
+    // replaced for the next graph.
+    result.stable = false;
+    result.iterations = 0;
+    result.error = NULL;
+    try {
+      if (!layout) layout.reset(new Layout<Real, Dim>());
+      *layout->getSettings() = settings;
+      layout->init(graph.links, graph.size);
+      for (; result.iterations < maxSteps && !result.stable; ++result.iterations) {
+        result.stable = layout->step();
+      }
+      result.positions.resize(layout->getBodiesCount() * Dim);
+      layout->getPositions(result.positions.data());
+    } catch (const char *message) {
+      result.error = message;
+    } catch (const std::bad_alloc &) {
+      result.error = "Out of memory";
+    } catch (...) {
+      result.error = "Unexpected error";
+    }
+    if (result.error) {
+      layout.reset();
+      result.positions.clear();
+    }
+  }
+}
+
+template class BatchLayout<float, 2>;
+template class BatchLayout<float, 3>;
+template class BatchLayout<double, 2>;
+template class BatchLayout<double, 3>;
@@ -0,0 +1,54 @@
+//
+//  batch.h
+//  layout++
+//
+
+#ifndef __layout____batch__
+#define __layout____batch__
+
+#include <vector>
+#include <memory>
+#include "layout.h"
+
+using namespace std;
+
+// Links of one graph of a batch, in the format Layout::init() reads. The
+// links are only read during BatchLayout::run().
+struct BatchGraph {
+  const int *links;
+  long size;
+};
+
+// What BatchLayout::run() made of one graph.
+struct BatchResult {
+  vector<int> positions; // `Dim` per body, as Layout::getPositions() writes them
+  size_t iterations;     // steps taken
+  bool stable;           // stopped by LayoutSettings::stableThreshold
+  const char *error;     // NULL, or why the graph has no positions
+};
+
+// Lays out many small graphs at once. Loops of a Layout over a few thousand
+// bodies are too short to be worth splitting between threads, so instead
+// every thread lays out whole graphs, one at a time and single threaded.
+// Graphs are handed out largest first, and a thread takes the next one as
+// soon as it is done, so threads stay busy until the batch runs out.
+//
+// Every thread keeps its own Layout between graphs and between runs, and
+// the layout initializes the next graph in the memory of the previous one:
+// body arrays, the graph and the tree are only reallocated when a graph is
+// bigger than all the ones before it. Positions are the same as a Layout
+// with the same settings gives for the graph alone.
+template <typename Real = double, int Dim = 3>
+class BatchLayout {
+  LayoutSettings settings;
+  vector<unique_ptr<Layout<Real, Dim>>> pool; // one layout per thread
+public:
+  // Settings of every graph. They are read when run() starts a graph.
+  LayoutSettings *getSettings() { return &settings; }
+  // Steps every graph until it is stable, or for maxSteps steps. results[i]
+  // belongs to graphs[i]. A graph that fails (an invalid graph, or out of
+  // memory) gets its error and no positions; the others still run.
+  void run(const vector<BatchGraph> &graphs, size_t maxSteps, vector<BatchResult> &results);
+};
+
+#endif /* defined(__layout____batch__) */
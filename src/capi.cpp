@@ -0,0 +1,286 @@
+//
+//  capi.cpp
+//  layout++
+//
+
+#include "ngraph.h"
+#include "layout.h"
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <exception>
+#include <new>
+
+// Every Layout<Real, Dim> behind one interface, so that the C functions do
+// not depend on the precision and number of dimensions.
+struct ngraph_layout {
+  virtual ~ngraph_layout() {}
+  virtual void init(const int *links, long size) = 0;
+  virtual void init(const int *links, long size, const int *positions, size_t count) = 0;
+  virtual void saveCheckpoint(const char *fileName) = 0;
+  virtual void resume(const int *links, long size, const char *fileName) = 0;
+  virtual bool step() = 0;
+  virtual size_t bodyCount() const = 0;
+  virtual int dimensions() const = 0;
+  virtual int precision() const = 0;
+  virtual const void *positionArray(int axis) const = 0;
+  virtual const void *massArray() const = 0;
+  virtual void copyPositions(int *positions) = 0;
+  virtual void setWeights(const int *weights) = 0;
+  virtual LayoutSettings &settings() = 0;
+};
+
+namespace {
+  thread_local const char *lastError = NULL;
+
+  template <typename Real, int Dim>
+  struct LayoutHandle : ngraph_layout {
+    Layout<Real, Dim> layout;
+
+    void init(const int *links, long size) { layout.init(links, size); }
+    void init(const int *links, long size, const int *positions, size_t count) {
+      layout.init(links, size, positions, count);
+    }
+    void saveCheckpoint(const char *fileName) { layout.saveCheckpoint(fileName); }
+    void resume(const int *links, long size, const char *fileName) { layout.resume(links, size, fileName); }
+    bool step() { return layout.step(); }
+    size_t bodyCount() const { return const_cast<Layout<Real, Dim> &>(layout).getBodiesCount(); }
+    int dimensions() const { return Dim; }
+    int precision() const { return sizeof(Real) == sizeof(float) ? NGRAPH_FLOAT : NGRAPH_DOUBLE; }
+    const void *positionArray(int axis) const { return layout.getPositionArray(axis); }
+    const void *massArray() const { return layout.getMassArray(); }
+    void copyPositions(int *positions) { layout.getPositions(positions); }
+    void setWeights(const int *weights) { layout.setBodiesWeight(weights); }
+    LayoutSettings &settings() { return *layout.getSettings(); }
+  };
+
+  // Exceptions must not cross the C boundary: every entry point runs its
+  // body through guard(), which turns them into `failed` and lastError.
+  template <typename Result, typename Body>
+  Result guard(Result failed, Body body) {
+    lastError = NULL;
+    try {
+      return body();
+    } catch (const char *message) {
+      lastError = message;
+    } catch (const std::bad_alloc &) {
+      lastError = "Out of memory";
+    } catch (...) {
+      lastError = "Unexpected error";
+    }
+    return failed;
+  }
+
+  // Whether `value` is a valid T: not NaN, and for integral types integral
+  // (0 or 1 for flags) and in range, as converting anything else to them is
+  // undefined. Integral settings are counts and sizes, none negative.
+  template <typename T>
+  bool fits(double value) {
+    if (std::is_floating_point<T>::value) return !std::isnan(value);
+    if (std::is_same<T, bool>::value) return value == 0 || value == 1;
+    // Largest values of 64-bit types are not doubles: compare with 2^64
+    // (2^63) itself, which is.
+    return value == std::trunc(value) && value >= 0 &&
+      value < std::ldexp(1.0, std::numeric_limits<T>::digits);
+  }
+
+  template <typename T>
+  bool accessField(const char *name, const char *fieldName, T &field, double *value, bool write) {
+    if (strcmp(name, fieldName) != 0) return false;
+    if (write) {
+      if (!fits<T>(*value)) throw "Invalid value of a setting";
+      field = (T)*value;
+    } else {
+      *value = (double)field;
+    }
+    return true;
+  }
+
+  template <typename Enum>
+  bool accessEnum(const char *name, const char *fieldName, Enum &field, int count, double *value, bool write) {
+    if (strcmp(name, fieldName) != 0) return false;
+    if (write) {
+      if (*value != (int)*value || *value < 0 || *value >= count) throw "Invalid value of an enum setting";
+      field = (Enum)(int)*value;
+    } else {
+      *value = (int)field;
+    }
+    return true;
+  }
+
+  // Reads or writes the field of LayoutSettings called `name`.
+  void accessSetting(LayoutSettings &s, const char *name, double *value, bool write) {
+    if (name == NULL) throw "Setting name is NULL";
+    bool found =
+      accessField(name, "stableThreshold", s.stableThreshold, value, write) ||
+      accessField(name, "gravity", s.gravity, value, write) ||
+      accessField(name, "theta", s.theta, value, write) ||
+      accessField(name, "dragCoeff", s.dragCoeff, value, write) ||
+      accessField(name, "springCoeff", s.springCoeff, value, write) ||
+      accessField(name, "springLength", s.springLength, value, write) ||
+      accessField(name, "timeStep", s.timeStep, value, write) ||
+      accessField(name, "leafCapacity", s.leafCapacity, value, write) ||
+      accessField(name, "groupTraversal", s.groupTraversal, value, write) ||
+      accessEnum(name, "repulsion", s.repulsion, 2, value, write) ||
+      accessField(name, "multipoleOrder", s.multipoleOrder, value, write) ||
+      accessField(name, "multipoleTheta", s.multipoleTheta, value, write) ||
+      accessField(name, "treeRefit", s.treeRefit, value, write) ||
+      accessField(name, "refitThreshold", s.refitThreshold, value, write) ||
+      accessField(name, "multilevel", s.multilevel, value, write) ||
+      accessField(name, "coarsestSize", s.coarsestSize, value, write) ||
+      accessField(name, "coarsestSteps", s.coarsestSteps, value, write) ||
+      accessField(name, "refineSteps", s.refineSteps, value, write) ||
+      accessEnum(name, "integrator", s.integrator, 2, value, write) ||
+      accessField(name, "swingTolerance", s.swingTolerance, value, write) ||
+      accessField(name, "numa", s.numa, value, write) ||
+      accessField(name, "rebalanceInterval", s.rebalanceInterval, value, write) ||
+      accessField(name, "seed", s.seed, value, write);
+    if (!found) throw "Unknown setting";
+  }
+
+  void checkLayout(const ngraph_layout *layout) {
+    if (layout == NULL) throw "Layout is NULL";
+  }
+}
+
+int ngraph_api_version(void) {
+  return NGRAPH_API_VERSION;
+}
+
+const char *ngraph_last_error(void) {
+  return lastError;
+}
+
+ngraph_layout *ngraph_create(int dimensions, int precision) {
+  return guard<ngraph_layout *>(NULL, [&]() -> ngraph_layout * {
+    if (precision == NGRAPH_DOUBLE && dimensions == 3) return new LayoutHandle<double, 3>();
+    if (precision == NGRAPH_DOUBLE && dimensions == 2) return new LayoutHandle<double, 2>();
+    if (precision == NGRAPH_FLOAT && dimensions == 3) return new LayoutHandle<float, 3>();
+    if (precision == NGRAPH_FLOAT && dimensions == 2) return new LayoutHandle<float, 2>();
+    throw "Unsupported dimensions or precision";
+  });
+}
+
+void ngraph_destroy(ngraph_layout *layout) {
+  delete layout;
+}
+
+int ngraph_init(ngraph_layout *layout, const int32_t *links, long size) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (links == NULL || size <= 0) throw "Links are empty";
+    layout->init(links, size);
+    return 0;
+  });
+}
+
+int ngraph_init_positions(ngraph_layout *layout, const int32_t *links, long size,
+                          const int32_t *positions, size_t count) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (links == NULL || size <= 0) throw "Links are empty";
+    if (positions == NULL) throw "Positions are NULL";
+    layout->init(links, size, positions, count);
+    return 0;
+  });
+}
+
+int ngraph_save_checkpoint(ngraph_layout *layout, const char *fileName) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (fileName == NULL) throw "File name is NULL";
+    layout->saveCheckpoint(fileName);
+    return 0;
+  });
+}
+
+int ngraph_resume(ngraph_layout *layout, const int32_t *links, long size, const char *fileName) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (links == NULL || size <= 0) throw "Links are empty";
+    if (fileName == NULL) throw "File name is NULL";
+    layout->resume(links, size, fileName);
+    return 0;
+  });
+}
+
+long ngraph_step(ngraph_layout *layout, long steps) {
+  return guard(-1L, [&]() {
+    checkLayout(layout);
+    long done = 0;
+    while (done < steps) {
+      done += 1;
+      if (layout->step()) break;
+    }
+    return done;
+  });
+}
+
+size_t ngraph_body_count(const ngraph_layout *layout) {
+  return layout == NULL ? 0 : layout->bodyCount();
+}
+
+int ngraph_positions(const ngraph_layout *layout, ngraph_positions_view *view) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (view == NULL) throw "View is NULL";
+    for (int axis = 0; axis < 3; ++axis) {
+      view->axes[axis] = axis < layout->dimensions() ? layout->positionArray(axis) : NULL;
+    }
+    view->count = layout->bodyCount();
+    view->precision = layout->precision();
+    view->stride = view->precision == NGRAPH_FLOAT ? sizeof(float) : sizeof(double);
+    view->dimensions = layout->dimensions();
+    return 0;
+  });
+}
+
+int ngraph_copy_positions(const ngraph_layout *layout, int32_t *positions, size_t count) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (positions == NULL || count != layout->bodyCount() * layout->dimensions()) {
+      throw "Positions buffer does not fit the bodies";
+    }
+    const_cast<ngraph_layout *>(layout)->copyPositions(positions);
+    return 0;
+  });
+}
+
+int ngraph_set_weights(ngraph_layout *layout, const int32_t *weights, size_t count) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (weights == NULL || count != layout->bodyCount()) throw "Need one weight per body";
+    layout->setWeights(weights);
+    return 0;
+  });
+}
+
+int ngraph_get_weights(const ngraph_layout *layout, double *weights, size_t count) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (weights == NULL || count != layout->bodyCount()) throw "Need one weight per body";
+    for (size_t i = 0; i < count; ++i) {
+      weights[i] = layout->precision() == NGRAPH_FLOAT ?
+        ((const float *)layout->massArray())[i] : ((const double *)layout->massArray())[i];
+    }
+    return 0;
+  });
+}
+
+int ngraph_set_setting(ngraph_layout *layout, const char *name, double value) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    accessSetting(layout->settings(), name, &value, true);
+    return 0;
+  });
+}
+
+int ngraph_get_setting(const ngraph_layout *layout, const char *name, double *value) {
+  return guard(-1, [&]() {
+    checkLayout(layout);
+    if (value == NULL) throw "Value is NULL";
+    accessSetting(const_cast<ngraph_layout *>(layout)->settings(), name, value, false);
+    return 0;
+  });
+}
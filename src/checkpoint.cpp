@@ -0,0 +1,94 @@
+//
+//  checkpoint.cpp
+//  layout++
+//
+
+#include "checkpoint.h"
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+  size_t alignUp(size_t bytes) {
+    return (bytes + checkpointAlignment - 1) / checkpointAlignment * checkpointAlignment;
+  }
+
+  // write() may write less than asked, e.g. on a signal.
+  bool writeAll(int file, const void *data, size_t bytes) {
+    const char *next = (const char *)data;
+    while (bytes > 0) {
+      ssize_t written = write(file, next, bytes);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return false;
+      next += written;
+      bytes -= (size_t)written;
+    }
+    return true;
+  }
+
+  bool writeArrays(int file, const CheckpointHeader &header, const vector<const void *> &arrays) {
+    const char padding[checkpointAlignment] = {};
+    if (!writeAll(file, &header, sizeof(header)) ||
+        !writeAll(file, padding, checkpointHeaderSize() - sizeof(header))) return false;
+    size_t bytes = header.bodyCount * header.realSize;
+    for (size_t i = 0; i < arrays.size(); ++i) {
+      if (!writeAll(file, arrays[i], bytes) ||
+          !writeAll(file, padding, checkpointArrayStride(header) - bytes)) return false;
+    }
+    return true;
+  }
+
+  // Makes the rename of a file in `fileName`'s directory durable.
+  void syncDirectory(const string &fileName) {
+    size_t slash = fileName.rfind('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : fileName.substr(0, slash);
+    int file = open(directory.c_str(), O_RDONLY);
+    if (file < 0) return;
+    fsync(file);
+    close(file);
+  }
+}
+
+size_t checkpointArrayStride(const CheckpointHeader &header) {
+  return alignUp(header.bodyCount * header.realSize);
+}
+
+size_t checkpointHeaderSize() {
+  return alignUp(sizeof(CheckpointHeader));
+}
+
+void writeCheckpoint(const char *fileName, const CheckpointHeader &header, const vector<const void *> &arrays) {
+  if (arrays.size() != header.arrayCount) throw "Checkpoint header does not match its arrays";
+  string temporary = string(fileName) + ".tmp";
+  int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) throw "Could not write checkpoint";
+
+  // The checkpoint must be on disk before it replaces the previous one: a
+  // machine stopped right after rename() must not leave a truncated file.
+  bool written = writeArrays(file, header, arrays) && fsync(file) == 0;
+  if (close(file) != 0) written = false;
+  if (!written) {
+    unlink(temporary.c_str());
+    throw "Could not write checkpoint";
+  }
+  if (rename(temporary.c_str(), fileName) != 0) throw "Could not replace checkpoint";
+  syncDirectory(fileName);
+}
+
+CheckpointFile::CheckpointFile(const char *fileName) : file(fileName) {
+  if (file.byteSize() < checkpointHeaderSize()) throw "Checkpoint file is truncated";
+  header = (const CheckpointHeader *)file.bytes();
+  if (memcmp(header->magic, checkpointMagic, sizeof(checkpointMagic)) != 0) throw "Not a checkpoint file";
+  if (header->version != checkpointVersion) throw "Unsupported checkpoint version";
+  if (file.byteSize() != checkpointHeaderSize() + header->arrayCount * checkpointArrayStride(*header)) {
+    throw "Checkpoint file is truncated";
+  }
+}
+
+const void *CheckpointFile::array(size_t index) const {
+  if (index >= header->arrayCount) throw "Checkpoint has no such array";
+  return file.bytes() + checkpointHeaderSize() + index * checkpointArrayStride(*header);
+}
@@ -0,0 +1,65 @@
+//
+//  checkpoint.h
+//  layout++
+//
+
+#ifndef __layout____checkpoint__
+#define __layout____checkpoint__
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "mappedFile.h"
+
+using namespace std;
+
+// A checkpoint file is this header, followed by arrays of `bodyCount`
+// values of `realSize` bytes each, every one starting at a multiple of
+// checkpointAlignment. Values are stored as they are in memory, so a
+// checkpoint is read on a machine of the same byte order only. Layout
+// writes pos of every axis, then velocity, force and previousForce the same
+// way, then mass (see Layout::saveCheckpoint()).
+struct CheckpointHeader {
+  char magic[8];         // checkpointMagic
+  uint32_t version;      // checkpointVersion
+  uint32_t dimensions;
+  uint32_t realSize;     // 4 for float, 8 for double
+  uint32_t arrayCount;
+  uint64_t bodyCount;
+  uint64_t fingerprint;  // Graph::fingerprint() of the laid out graph
+  // Random numbers are keyed by seed and step (see CounterRandom), so these
+  // two are the whole state of the generator.
+  uint64_t seed;
+  uint64_t iteration;
+  double speed;          // of Integrator::Adaptive
+};
+
+const char checkpointMagic[8] = { 'N', 'G', 'R', 'A', 'P', 'H', 'C', 'K' };
+const uint32_t checkpointVersion = 1;
+const size_t checkpointAlignment = 64;
+
+// Bytes from the start of one array to the start of the next, and from the
+// start of the file to the first array.
+size_t checkpointArrayStride(const CheckpointHeader &header);
+size_t checkpointHeaderSize();
+
+// Writes the header and the arrays into `fileName` + ".tmp", syncs it to
+// disk, then renames it to `fileName`, so that a run or a machine stopped
+// halfway leaves the previous checkpoint in place. Throws when the file
+// cannot be written.
+void writeCheckpoint(const char *fileName, const CheckpointHeader &header, const vector<const void *> &arrays);
+
+// Maps a checkpoint and checks its header and size. Arrays are read
+// straight from the mapping.
+class CheckpointFile {
+  MappedFile file;
+  const CheckpointHeader *header;
+public:
+  // Throws when the file is not a checkpoint of this version.
+  CheckpointFile(const char *fileName);
+
+  const CheckpointHeader &getHeader() const { return *header; }
+  const void *array(size_t index) const;
+};
+
+#endif /* defined(__layout____checkpoint__) */
@@ -0,0 +1,348 @@
+//
+//  graph.cpp
+//  layout++
+//
+
+#include "graph.h"
+#include <algorithm>
+#include <utility>
+
+namespace {
+  // Links are scanned in chunks of about this many records. Chunks always
+  // start at a source marker, so a run of targets is never split.
+  const long chunkSize = 1 << 20;
+
+  // A run of targets that follows one source marker.
+  struct Segment {
+    int from;
+    long begin, end; // targets are links[begin] ... links[end - 1]
+    size_t rowOffset; // where the run starts within the row of `from`
+  };
+
+  struct Chunk {
+    long begin, end;
+    int maxBodyId;
+    vector<Segment> segments;
+  };
+}
+
+void Graph::build(const int *links, long size) {
+  // FIXME: If there are no links in a graph, it will fail
+
+  // Chunk boundaries are moved forward to the next source marker.
+  vector<Chunk> chunks;
+  for (long begin = 0; begin < size;) {
+    long end = min(size, begin + chunkSize);
+    while (end < size && links[end] >= 0) end += 1;
+    Chunk chunk;
+    chunk.begin = begin;
+    chunk.end = end;
+    chunk.maxBodyId = 0;
+    chunks.push_back(chunk);
+    begin = end;
+  }
+
+  // since we can have holes in the original list - let's
+  // figure out max node id, and then initialize bodies.
+  // Every chunk finds its own maximum and runs of targets.
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t c = 0; c < chunks.size(); ++c) {
+    Chunk &chunk = chunks[c];
+    int maxBodyId = 0;
+    for (long i = chunk.begin; i < chunk.end; i++) {
+      int index = links[i];
+      int id = (index < 0 ? -index : index) - 1;
+      if (id > maxBodyId) maxBodyId = id;
+      if (index < 0 || i == 0) {
+        // Targets before the first marker belong to body 0.
+        Segment segment;
+        segment.from = index < 0 ? id : 0;
+        segment.begin = index < 0 ? i + 1 : i;
+        segment.end = segment.begin;
+        chunk.segments.push_back(segment);
+      }
+      if (index > 0) chunk.segments.back().end = i + 1;
+    }
+    chunk.maxBodyId = maxBodyId;
+  }
+
+  int maxBodyId = 0;
+  for (size_t c = 0; c < chunks.size(); ++c) {
+    maxBodyId = max(maxBodyId, chunks[c].maxBodyId);
+  }
+
+  size_t count = maxBodyId + 1;
+  offsets.assign(count + 1, 0);
+  incomingCount.assign(count, 0);
+
+  // Counting pass over runs, in file order: out degree goes to
+  // offsets[from + 1], so that the prefix sum below turns it into the start
+  // of the next body's row. A body listed under several markers gets its
+  // runs in the order they appear in the file.
+  for (size_t c = 0; c < chunks.size(); ++c) {
+    vector<Segment> &segments = chunks[c].segments;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      segments[s].rowOffset = offsets[segments[s].from + 1];
+      offsets[segments[s].from + 1] += segments[s].end - segments[s].begin;
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    offsets[i + 1] += offsets[i];
+  }
+
+  // Now that every run knows where it goes, let's add links:
+  targets.resize(offsets[count]);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t c = 0; c < chunks.size(); ++c) {
+    const vector<Segment> &segments = chunks[c].segments;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      size_t row = offsets[segments[s].from] + segments[s].rowOffset;
+      for (long i = segments[s].begin; i < segments[s].end; ++i) {
+        targets[row++] = links[i] - 1;
+      }
+    }
+  }
+
+  for (size_t j = 0; j < targets.size(); ++j) {
+    incomingCount[targets[j]] += 1;
+  }
+
+  outgoing.clear();
+  incoming.clear();
+  editable = false;
+  dirty = false;
+  buildNeighbours();
+}
+
+void Graph::buildNeighbours() {
+  size_t count = size();
+
+  // Every body is connected to its outgoing links, followed by its incoming
+  // links ordered by source. Incoming links are scattered all over the
+  // rows, and are added by a single pass in source order, so that no two
+  // threads compete for a row and the order is always the same.
+  neighbourOffsets.assign(count + 1, 0);
+  for (size_t i = 0; i < count; ++i) {
+    neighbourOffsets[i + 1] = neighbourOffsets[i] + degree(i) + incomingCount[i];
+  }
+  neighbourTargets.resize(neighbourOffsets[count]);
+  vector<size_t> cursor(count);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < count; ++i) {
+    copy(springs(i), springs(i) + degree(i), neighbourTargets.begin() + neighbourOffsets[i]);
+    cursor[i] = neighbourOffsets[i] + degree(i);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+      neighbourTargets[cursor[targets[j]]++] = (int)i;
+    }
+  }
+}
+
+namespace {
+  bool eraseOne(vector<int> &list, int value) {
+    vector<int>::iterator found = find(list.begin(), list.end(), value);
+    if (found == list.end()) return false;
+    list.erase(found);
+    return true;
+  }
+
+  void replaceOne(vector<int> &list, int value, int replacement) {
+    vector<int>::iterator found = find(list.begin(), list.end(), value);
+    if (found != list.end()) *found = replacement;
+  }
+}
+
+void Graph::makeEditable() {
+  if (editable) return;
+  size_t count = size();
+  outgoing.resize(count);
+  incoming.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    outgoing[i].assign(springs(i), springs(i) + degree(i));
+    incoming[i].reserve(incomingCount[i]);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < degree(i); ++j) incoming[springs(i)[j]].push_back((int)i);
+  }
+  editable = true;
+}
+
+size_t Graph::nodeCount() const {
+  return editable ? outgoing.size() : size();
+}
+
+size_t Graph::linkCount(size_t body) const {
+  if (editable) return outgoing[body].size() + incoming[body].size();
+  return degree(body) + incomingCount[body];
+}
+
+vector<int> Graph::linkedBodies(size_t body) const {
+  if (!editable) return vector<int>(neighbours(body), neighbours(body) + neighbourCount(body));
+  vector<int> result(outgoing[body]);
+  result.insert(result.end(), incoming[body].begin(), incoming[body].end());
+  return result;
+}
+
+int Graph::addNode() {
+  makeEditable();
+  outgoing.push_back(vector<int>());
+  incoming.push_back(vector<int>());
+  dirty = true;
+  return (int)outgoing.size() - 1;
+}
+
+void Graph::addLink(int from, int to) {
+  makeEditable();
+  if (from < 0 || to < 0 || (size_t)from >= outgoing.size() || (size_t)to >= outgoing.size()) {
+    throw "Link refers to a missing node";
+  }
+  outgoing[from].push_back(to);
+  incoming[to].push_back(from);
+  dirty = true;
+}
+
+bool Graph::removeLink(int from, int to) {
+  makeEditable();
+  if (from < 0 || to < 0 || (size_t)from >= outgoing.size() || (size_t)to >= outgoing.size()) {
+    return false;
+  }
+  if (!eraseOne(outgoing[from], to)) return false;
+  eraseOne(incoming[to], from);
+  dirty = true;
+  return true;
+}
+
+int Graph::removeNode(int id) {
+  makeEditable();
+  if (id < 0 || (size_t)id >= outgoing.size()) throw "Node does not exist";
+
+  for (size_t i = 0; i < outgoing[id].size(); ++i) {
+    if (outgoing[id][i] != id) eraseOne(incoming[outgoing[id][i]], id);
+  }
+  for (size_t i = 0; i < incoming[id].size(); ++i) {
+    if (incoming[id][i] != id) eraseOne(outgoing[incoming[id][i]], id);
+  }
+
+  // Move the last body into the free slot, and rename it in the lists of
+  // its neighbours. Links of the body to itself are renamed at the end.
+  int last = (int)outgoing.size() - 1;
+  vector<int> out, in;
+  out.swap(outgoing[last]);
+  in.swap(incoming[last]);
+  for (size_t i = 0; i < out.size(); ++i) {
+    if (out[i] != last) replaceOne(incoming[out[i]], last, id);
+  }
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (in[i] != last) replaceOne(outgoing[in[i]], last, id);
+  }
+  replace(out.begin(), out.end(), last, id);
+  replace(in.begin(), in.end(), last, id);
+  outgoing[id].swap(out);
+  incoming[id].swap(in);
+  outgoing.pop_back();
+  incoming.pop_back();
+
+  dirty = true;
+  return last;
+}
+
+void Graph::commit() {
+  if (!dirty) return;
+  size_t count = outgoing.size();
+  offsets.assign(count + 1, 0);
+  incomingCount.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    offsets[i + 1] = offsets[i] + outgoing[i].size();
+    incomingCount[i] = (int)incoming[i].size();
+  }
+  targets.resize(offsets[count]);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < count; ++i) {
+    copy(outgoing[i].begin(), outgoing[i].end(), targets.begin() + offsets[i]);
+  }
+
+  buildNeighbours();
+  dirty = false;
+}
+
+size_t Graph::coarsen(const vector<double> &weight, vector<int> &parent, vector<int> &links) const {
+  size_t count = size();
+  parent.assign(count, -1);
+  vector<double> groupWeight;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (parent[i] >= 0) continue;
+    int pair = -1;
+    const int *linked = neighbours(i);
+    for (size_t j = 0; j < neighbourCount(i); ++j) {
+      int other = linked[j];
+      if ((size_t)other == i || parent[other] >= 0) continue;
+      if (pair < 0 || weight[other] < weight[pair]) pair = other;
+    }
+    if (pair < 0) continue;
+    parent[i] = parent[pair] = (int)groupWeight.size();
+    groupWeight.push_back(weight[i] + weight[pair]);
+  }
+
+  // Every neighbour of a body without a pair is matched already, otherwise
+  // the two would have been paired above.
+  for (size_t i = 0; i < count; ++i) {
+    if (parent[i] >= 0) continue;
+    int group = -1;
+    const int *linked = neighbours(i);
+    for (size_t j = 0; j < neighbourCount(i); ++j) {
+      int other = parent[linked[j]];
+      if (other >= 0 && (group < 0 || groupWeight[other] < groupWeight[group])) group = other;
+    }
+    if (group < 0) {
+      group = (int)groupWeight.size();
+      groupWeight.push_back(0);
+    }
+    parent[i] = group;
+    groupWeight[group] += weight[i];
+  }
+
+  // Links between groups, each pair once whatever its direction.
+  vector<pair<int, int>> pairs;
+  pairs.reserve(targets.size());
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+      int from = parent[i], to = parent[targets[j]];
+      if (from != to) pairs.push_back(make_pair(min(from, to), max(from, to)));
+    }
+  }
+  sort(pairs.begin(), pairs.end());
+  pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+  // Every coarse body gets a marker, even without links, so that build()
+  // sees all of them.
+  size_t groups = groupWeight.size();
+  links.clear();
+  links.reserve(groups + pairs.size());
+  size_t next = 0;
+  for (size_t group = 0; group < groups; ++group) {
+    links.push_back(-(int)(group + 1));
+    for (; next < pairs.size() && (size_t)pairs[next].first == group; ++next) {
+      links.push_back(pairs[next].second + 1);
+    }
+  }
+  return groups;
+}
+
+uint64_t Graph::fingerprint() const {
+  // FNV-1a over 32-bit words rather than bytes.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const uint64_t prime = 0x100000001b3ull;
+  hash = (hash ^ size()) * prime;
+  for (size_t i = 0; i < size(); ++i) {
+    hash = (hash ^ degree(i)) * prime;
+    const int *row = springs(i);
+    for (size_t j = 0; j < degree(i); ++j) hash = (hash ^ (uint32_t)row[j]) * prime;
+  }
+  return hash;
+}
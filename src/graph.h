@@ -0,0 +1,107 @@
+//
+//  graph.h
+//  layout++
+//
+
+#ifndef __layout____graph__
+#define __layout____graph__
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Compressed sparse row adjacency of the graph. Outgoing connections
+// (springs) of body `i` are stored in
+//
+//   targets[offsets[i]] ... targets[offsets[i + 1] - 1]
+//
+// so the whole graph lives in two flat arrays instead of one heap-allocated
+// vector per body.
+struct Graph {
+  vector<size_t> offsets;
+  vector<int> targets;
+  // Number of incoming connections of each body. Together with the out
+  // degree it defines the body's mass.
+  vector<int> incomingCount;
+  // The same springs seen from both ends: row `i` lists every body connected
+  // to `i`, by outgoing or incoming link. A spring appears in the rows of
+  // both of its bodies, so each body can sum the spring forces acting on it
+  // without writing to its neighbours.
+  vector<size_t> neighbourOffsets;
+  vector<int> neighbourTargets;
+
+  // Builds adjacency from ngraph.tobinary links buffer: a negative value
+  // -(id + 1) starts a list of outgoing links of node `id`, positive values
+  // (id + 1) that follow are its targets.
+  void build(const int *links, long size);
+
+  size_t size() const { return incomingCount.size(); }
+
+  size_t degree(size_t body) const {
+    return offsets[body + 1] - offsets[body];
+  }
+
+  const int *springs(size_t body) const {
+    return targets.data() + offsets[body];
+  }
+
+  size_t neighbourCount(size_t body) const {
+    return neighbourOffsets[body + 1] - neighbourOffsets[body];
+  }
+
+  const int *neighbours(size_t body) const {
+    return neighbourTargets.data() + neighbourOffsets[body];
+  }
+
+  // Editing. The first edit copies the graph into a list of outgoing and
+  // incoming links per body, which later edits update in O(degree); the
+  // arrays above are left as they are until commit() rebuilds them. The
+  // lists are kept afterwards, so a graph that is edited once uses about
+  // twice as much memory.
+
+  // Adds a body without links and returns its id.
+  int addNode();
+  void addLink(int from, int to);
+  // Removes one link from -> to. Returns false if there is no such link.
+  bool removeLink(int from, int to);
+  // Removes the body with all its links. The last body takes its id, so
+  // ids stay dense: returns the old id of the moved body (`id` itself if it
+  // was the last one).
+  int removeNode(int id);
+  // Number of bodies, counting edits that are not committed yet.
+  size_t nodeCount() const;
+  // Number of links (outgoing and incoming) of a body, counting edits that
+  // are not committed yet.
+  size_t linkCount(size_t body) const;
+  // Bodies linked to `body` in either direction, counting edits that are
+  // not committed yet.
+  vector<int> linkedBodies(size_t body) const;
+  bool isDirty() const { return dirty; }
+  void commit();
+
+  // Collapses the graph for a multilevel layout. Every body is matched with
+  // its lightest unmatched neighbour (by `weight`), and the pair becomes one
+  // body of the coarser graph. Bodies left without a pair join the lightest
+  // group next to them, so a hub swallows its leaves. `parent[i]` is the
+  // coarse body that body `i` went to. `links` gets the coarse graph in the
+  // format build() reads, with one link per pair of linked coarse bodies.
+  // Returns the number of coarse bodies.
+  size_t coarsen(const vector<double> &weight, vector<int> &parent, vector<int> &links) const;
+
+  // Hash of the committed graph: its number of bodies and the outgoing
+  // links of each. Links files that build the same graph give the same
+  // fingerprint.
+  uint64_t fingerprint() const;
+
+private:
+  vector<vector<int>> outgoing, incoming;
+  bool editable = false;
+  bool dirty = false;
+
+  void makeEditable();
+  void buildNeighbours();
+};
+
+#endif /* defined(__layout____graph__) */
@@ -0,0 +1,362 @@
+//
+//  kernels.cpp
+//  layout++
+//
+//  Vector kernels are written once against a thin wrapper of intrinsics
+//  (Avx2<Real>, Avx512<Real>) and instantiated for every precision and
+//  dimension. Loops over axes have compile time bounds and are unrolled.
+//
+
+#include "kernels.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LAYOUT_X86_KERNELS 1
+#include <immintrin.h>
+#define AVX2_FUNCTION __attribute__((target("avx2,fma")))
+#define AVX2_INLINE __attribute__((target("avx2,fma"), always_inline)) static inline
+#define AVX512_FUNCTION __attribute__((target("avx512f")))
+#define AVX512_INLINE __attribute__((target("avx512f"), always_inline)) static inline
+#endif
+
+namespace {
+  template <typename Real, int Dim>
+  void repulsionScalar(const Real *const *position, const Real *mass, size_t count,
+                       const Real *point, double *force) {
+    double total[Dim] = {};
+    for (size_t k = 0; k < count; ++k) {
+      Real d[Dim];
+      Real r2 = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        d[axis] = position[axis][k] - point[axis];
+        r2 += d[axis] * d[axis];
+      }
+      Real r = std::sqrt(r2);
+      Real v = r2 > 0 ? mass[k] / (r2 * r) : 0;
+      for (int axis = 0; axis < Dim; ++axis) total[axis] += v * d[axis];
+    }
+    for (int axis = 0; axis < Dim; ++axis) force[axis] += total[axis];
+  }
+
+  template <typename Real, int Dim>
+  void springsScalar(const Real *const *position, size_t count, const Real *point,
+                     Real length, Real coeff, double *force) {
+    double total[Dim] = {};
+    for (size_t k = 0; k < count; ++k) {
+      Real d[Dim];
+      Real r2 = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        d[axis] = position[axis][k] - point[axis];
+        r2 += d[axis] * d[axis];
+      }
+      Real r = std::sqrt(r2);
+      Real v = r2 > 0 ? coeff * (r - length) / r : 0;
+      for (int axis = 0; axis < Dim; ++axis) total[axis] += v * d[axis];
+    }
+    for (int axis = 0; axis < Dim; ++axis) force[axis] += total[axis];
+  }
+
+#ifdef LAYOUT_X86_KERNELS
+  // Full width lanes, masking is done with vectors of all ones or zeros.
+  template <typename Real> struct Avx2;
+
+  template <> struct Avx2<double> {
+    typedef __m256d Vector;
+    static const size_t width = 4;
+    AVX2_INLINE Vector broadcast(double v) { return _mm256_set1_pd(v); }
+    AVX2_INLINE Vector load(const double *p) { return _mm256_loadu_pd(p); }
+    AVX2_INLINE Vector add(Vector a, Vector b) { return _mm256_add_pd(a, b); }
+    AVX2_INLINE Vector sub(Vector a, Vector b) { return _mm256_sub_pd(a, b); }
+    AVX2_INLINE Vector mul(Vector a, Vector b) { return _mm256_mul_pd(a, b); }
+    AVX2_INLINE Vector div(Vector a, Vector b) { return _mm256_div_pd(a, b); }
+    AVX2_INLINE Vector fmadd(Vector a, Vector b, Vector c) { return _mm256_fmadd_pd(a, b, c); }
+    AVX2_INLINE Vector sqrt(Vector v) { return _mm256_sqrt_pd(v); }
+    AVX2_INLINE Vector positive(Vector v) { return _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_GT_OQ); }
+    // `v` where `mask` is set, `otherwise` elsewhere
+    AVX2_INLINE Vector select(Vector mask, Vector v, Vector otherwise) { return _mm256_blendv_pd(otherwise, v, mask); }
+    AVX2_INLINE Vector keep(Vector v, Vector mask) { return _mm256_and_pd(v, mask); }
+    AVX2_INLINE double sum(Vector v) {
+      __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+      return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+    }
+  };
+
+  template <> struct Avx2<float> {
+    typedef __m256 Vector;
+    static const size_t width = 8;
+    AVX2_INLINE Vector broadcast(float v) { return _mm256_set1_ps(v); }
+    AVX2_INLINE Vector load(const float *p) { return _mm256_loadu_ps(p); }
+    AVX2_INLINE Vector add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+    AVX2_INLINE Vector sub(Vector a, Vector b) { return _mm256_sub_ps(a, b); }
+    AVX2_INLINE Vector mul(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+    AVX2_INLINE Vector div(Vector a, Vector b) { return _mm256_div_ps(a, b); }
+    AVX2_INLINE Vector fmadd(Vector a, Vector b, Vector c) { return _mm256_fmadd_ps(a, b, c); }
+    AVX2_INLINE Vector sqrt(Vector v) { return _mm256_sqrt_ps(v); }
+    AVX2_INLINE Vector positive(Vector v) { return _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GT_OQ); }
+    AVX2_INLINE Vector select(Vector mask, Vector v, Vector otherwise) { return _mm256_blendv_ps(otherwise, v, mask); }
+    AVX2_INLINE Vector keep(Vector v, Vector mask) { return _mm256_and_ps(v, mask); }
+    AVX2_INLINE double sum(Vector v) {
+      float lanes[8];
+      _mm256_storeu_ps(lanes, v);
+      double total = 0;
+      for (int i = 0; i < 8; ++i) total += lanes[i];
+      return total;
+    }
+  };
+
+  template <typename Real, int Dim>
+  AVX2_FUNCTION
+  void repulsionAvx2(const Real *const *position, const Real *mass, size_t count,
+                     const Real *point, double *force) {
+    typedef Avx2<Real> S;
+    typedef typename S::Vector Vector;
+    const Vector zero = S::broadcast(0), one = S::broadcast(1);
+    Vector origin[Dim], total[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      origin[axis] = S::broadcast(point[axis]);
+      total[axis] = zero;
+    }
+    size_t k = 0;
+    for (; k + S::width <= count; k += S::width) {
+      Vector d[Dim];
+      for (int axis = 0; axis < Dim; ++axis) d[axis] = S::sub(S::load(position[axis] + k), origin[axis]);
+      Vector r2 = S::mul(d[0], d[0]);
+      for (int axis = 1; axis < Dim; ++axis) r2 = S::fmadd(d[axis], d[axis], r2);
+      Vector nonZero = S::positive(r2);
+      Vector safeR2 = S::select(nonZero, r2, one);
+      Vector r3 = S::mul(safeR2, S::sqrt(safeR2));
+      Vector v = S::keep(S::div(S::load(mass + k), r3), nonZero);
+      for (int axis = 0; axis < Dim; ++axis) total[axis] = S::fmadd(v, d[axis], total[axis]);
+    }
+
+    double tail[Dim];
+    const Real *rest[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      tail[axis] = S::sum(total[axis]);
+      rest[axis] = position[axis] + k;
+    }
+    repulsionScalar<Real, Dim>(rest, mass + k, count - k, point, tail);
+    for (int axis = 0; axis < Dim; ++axis) force[axis] += tail[axis];
+  }
+
+  template <typename Real, int Dim>
+  AVX2_FUNCTION
+  void springsAvx2(const Real *const *position, size_t count, const Real *point,
+                   Real length, Real coeff, double *force) {
+    typedef Avx2<Real> S;
+    typedef typename S::Vector Vector;
+    const Vector zero = S::broadcast(0), one = S::broadcast(1);
+    const Vector springLength = S::broadcast(length), springCoeff = S::broadcast(coeff);
+    Vector origin[Dim], total[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      origin[axis] = S::broadcast(point[axis]);
+      total[axis] = zero;
+    }
+    size_t k = 0;
+    for (; k + S::width <= count; k += S::width) {
+      Vector d[Dim];
+      for (int axis = 0; axis < Dim; ++axis) d[axis] = S::sub(S::load(position[axis] + k), origin[axis]);
+      Vector r2 = S::mul(d[0], d[0]);
+      for (int axis = 1; axis < Dim; ++axis) r2 = S::fmadd(d[axis], d[axis], r2);
+      Vector nonZero = S::positive(r2);
+      Vector r = S::sqrt(S::select(nonZero, r2, one));
+      Vector v = S::keep(S::div(S::mul(springCoeff, S::sub(r, springLength)), r), nonZero);
+      for (int axis = 0; axis < Dim; ++axis) total[axis] = S::fmadd(v, d[axis], total[axis]);
+    }
+
+    double tail[Dim];
+    const Real *rest[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      tail[axis] = S::sum(total[axis]);
+      rest[axis] = position[axis] + k;
+    }
+    springsScalar<Real, Dim>(rest, count - k, point, length, coeff, tail);
+    for (int axis = 0; axis < Dim; ++axis) force[axis] += tail[axis];
+  }
+
+  // Mask registers: the last, partial group of lanes is loaded with a mask
+  // instead of going through a scalar tail.
+  template <typename Real> struct Avx512;
+
+  template <> struct Avx512<double> {
+    typedef __m512d Vector;
+    typedef __mmask8 Mask;
+    static const size_t width = 8;
+    AVX512_INLINE Mask lanes(size_t left) { return left >= 8 ? 0xff : (Mask)((1u << left) - 1); }
+    AVX512_INLINE Vector broadcast(double v) { return _mm512_set1_pd(v); }
+    AVX512_INLINE Vector load(Mask m, const double *p) { return _mm512_maskz_loadu_pd(m, p); }
+    AVX512_INLINE Vector add(Vector a, Vector b) { return _mm512_add_pd(a, b); }
+    AVX512_INLINE Vector sub(Vector a, Vector b) { return _mm512_sub_pd(a, b); }
+    AVX512_INLINE Vector mul(Vector a, Vector b) { return _mm512_mul_pd(a, b); }
+    AVX512_INLINE Vector fmadd(Vector a, Vector b, Vector c) { return _mm512_fmadd_pd(a, b, c); }
+    AVX512_INLINE Mask positive(Mask m, Vector v) { return _mm512_mask_cmp_pd_mask(m, v, _mm512_setzero_pd(), _CMP_GT_OQ); }
+    // Lanes outside of `m` become `otherwise` (select, sqrt) or zero (div).
+    AVX512_INLINE Vector select(Mask m, Vector v, Vector otherwise) { return _mm512_mask_mov_pd(otherwise, m, v); }
+    AVX512_INLINE Vector sqrt(Mask m, Vector v, Vector otherwise) { return _mm512_mask_sqrt_pd(otherwise, m, v); }
+    AVX512_INLINE Vector div(Mask m, Vector a, Vector b) { return _mm512_maskz_div_pd(m, a, b); }
+    AVX512_INLINE double sum(Vector v) {
+      double lanes[8];
+      _mm512_storeu_pd(lanes, v);
+      return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    }
+  };
+
+  template <> struct Avx512<float> {
+    typedef __m512 Vector;
+    typedef __mmask16 Mask;
+    static const size_t width = 16;
+    AVX512_INLINE Mask lanes(size_t left) { return left >= 16 ? 0xffff : (Mask)((1u << left) - 1); }
+    AVX512_INLINE Vector broadcast(float v) { return _mm512_set1_ps(v); }
+    AVX512_INLINE Vector load(Mask m, const float *p) { return _mm512_maskz_loadu_ps(m, p); }
+    AVX512_INLINE Vector add(Vector a, Vector b) { return _mm512_add_ps(a, b); }
+    AVX512_INLINE Vector sub(Vector a, Vector b) { return _mm512_sub_ps(a, b); }
+    AVX512_INLINE Vector mul(Vector a, Vector b) { return _mm512_mul_ps(a, b); }
+    AVX512_INLINE Vector fmadd(Vector a, Vector b, Vector c) { return _mm512_fmadd_ps(a, b, c); }
+    AVX512_INLINE Mask positive(Mask m, Vector v) { return _mm512_mask_cmp_ps_mask(m, v, _mm512_setzero_ps(), _CMP_GT_OQ); }
+    AVX512_INLINE Vector select(Mask m, Vector v, Vector otherwise) { return _mm512_mask_mov_ps(otherwise, m, v); }
+    AVX512_INLINE Vector sqrt(Mask m, Vector v, Vector otherwise) { return _mm512_mask_sqrt_ps(otherwise, m, v); }
+    AVX512_INLINE Vector div(Mask m, Vector a, Vector b) { return _mm512_maskz_div_ps(m, a, b); }
+    AVX512_INLINE double sum(Vector v) {
+      float lanes[16];
+      _mm512_storeu_ps(lanes, v);
+      double total = 0;
+      for (int i = 0; i < 16; ++i) total += lanes[i];
+      return total;
+    }
+  };
+
+  template <typename Real, int Dim>
+  AVX512_FUNCTION
+  void repulsionAvx512(const Real *const *position, const Real *mass, size_t count,
+                       const Real *point, double *force) {
+    typedef Avx512<Real> S;
+    typedef typename S::Vector Vector;
+    typedef typename S::Mask Mask;
+    const Vector zero = S::broadcast(0), one = S::broadcast(1);
+    Vector origin[Dim], total[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      origin[axis] = S::broadcast(point[axis]);
+      total[axis] = zero;
+    }
+    for (size_t k = 0; k < count; k += S::width) {
+      Mask lanes = S::lanes(count - k);
+      Vector d[Dim];
+      for (int axis = 0; axis < Dim; ++axis) d[axis] = S::sub(S::load(lanes, position[axis] + k), origin[axis]);
+      Vector r2 = S::mul(d[0], d[0]);
+      for (int axis = 1; axis < Dim; ++axis) r2 = S::fmadd(d[axis], d[axis], r2);
+      Mask nonZero = S::positive(lanes, r2);
+      Vector safeR2 = S::select(nonZero, r2, one);
+      Vector r3 = S::mul(safeR2, S::sqrt(nonZero, r2, one));
+      Vector v = S::div(nonZero, S::load(lanes, mass + k), r3);
+      for (int axis = 0; axis < Dim; ++axis) total[axis] = S::fmadd(v, d[axis], total[axis]);
+    }
+    for (int axis = 0; axis < Dim; ++axis) force[axis] += S::sum(total[axis]);
+  }
+
+  template <typename Real, int Dim>
+  AVX512_FUNCTION
+  void springsAvx512(const Real *const *position, size_t count, const Real *point,
+                     Real length, Real coeff, double *force) {
+    typedef Avx512<Real> S;
+    typedef typename S::Vector Vector;
+    typedef typename S::Mask Mask;
+    const Vector zero = S::broadcast(0), one = S::broadcast(1);
+    const Vector springLength = S::broadcast(length), springCoeff = S::broadcast(coeff);
+    Vector origin[Dim], total[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      origin[axis] = S::broadcast(point[axis]);
+      total[axis] = zero;
+    }
+    for (size_t k = 0; k < count; k += S::width) {
+      Mask lanes = S::lanes(count - k);
+      Vector d[Dim];
+      for (int axis = 0; axis < Dim; ++axis) d[axis] = S::sub(S::load(lanes, position[axis] + k), origin[axis]);
+      Vector r2 = S::mul(d[0], d[0]);
+      for (int axis = 1; axis < Dim; ++axis) r2 = S::fmadd(d[axis], d[axis], r2);
+      Mask nonZero = S::positive(lanes, r2);
+      Vector r = S::sqrt(nonZero, r2, one);
+      Vector v = S::div(nonZero, S::mul(springCoeff, S::sub(r, springLength)), r);
+      for (int axis = 0; axis < Dim; ++axis) total[axis] = S::fmadd(v, d[axis], total[axis]);
+    }
+    for (int axis = 0; axis < Dim; ++axis) force[axis] += S::sum(total[axis]);
+  }
+#endif
+
+  template <typename Real, int Dim>
+  struct KernelSets {
+    const ForceKernels<Real, Dim> *scalar, *avx2, *avx512;
+  };
+
+  template <typename Real, int Dim>
+  KernelSets<Real, Dim> kernelSets() {
+    static const ForceKernels<Real, Dim> scalar = {
+      "scalar", 1, repulsionScalar<Real, Dim>, springsScalar<Real, Dim>
+    };
+#ifdef LAYOUT_X86_KERNELS
+    static const ForceKernels<Real, Dim> avx2 = {
+      "avx2", Avx2<Real>::width, repulsionAvx2<Real, Dim>, springsAvx2<Real, Dim>
+    };
+    static const ForceKernels<Real, Dim> avx512 = {
+      "avx512", Avx512<Real>::width, repulsionAvx512<Real, Dim>, springsAvx512<Real, Dim>
+    };
+    KernelSets<Real, Dim> sets = { &scalar, &avx2, &avx512 };
+#else
+    KernelSets<Real, Dim> sets = { &scalar, NULL, NULL };
+#endif
+    return sets;
+  }
+
+  // NGRAPH_KERNELS, or NULL when it is not set. Anything but the names of
+  // kernel sets is ignored with a warning (once for all types), rather than
+  // silently picking some set.
+  const char *requestedKernels() {
+    static const char *requested = []() -> const char * {
+      const char *value = getenv("NGRAPH_KERNELS");
+      if (!value || !*value) return NULL;
+      if (strcmp(value, "scalar") == 0 || strcmp(value, "avx2") == 0 || strcmp(value, "avx512") == 0) {
+        return value;
+      }
+      std::cerr << "Unknown NGRAPH_KERNELS value " << value
+      << " (expected scalar, avx2 or avx512), picking kernels by the CPU" << std::endl;
+      return NULL;
+    }();
+    return requested;
+  }
+
+  template <typename Real, int Dim>
+  const ForceKernels<Real, Dim> *detectKernels() {
+    KernelSets<Real, Dim> sets = kernelSets<Real, Dim>();
+    const char *requested = requestedKernels();
+    if (requested && strcmp(requested, "scalar") == 0) return sets.scalar;
+#ifdef LAYOUT_X86_KERNELS
+    __builtin_cpu_init();
+    bool allowAvx512 = !requested || strcmp(requested, "avx512") == 0;
+    if (allowAvx512 && __builtin_cpu_supports("avx512f")) return sets.avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return sets.avx2;
+#endif
+    return sets.scalar;
+  }
+}
+
+template <typename Real, int Dim>
+const ForceKernels<Real, Dim> &scalarKernels() {
+  return *kernelSets<Real, Dim>().scalar;
+}
+
+template <typename Real, int Dim>
+const ForceKernels<Real, Dim> &selectKernels() {
+  static const ForceKernels<Real, Dim> *kernels = detectKernels<Real, Dim>();
+  return *kernels;
+}
+
+template const ForceKernels<float, 2> &scalarKernels<float, 2>();
+template const ForceKernels<float, 3> &scalarKernels<float, 3>();
+template const ForceKernels<double, 2> &scalarKernels<double, 2>();
+template const ForceKernels<double, 3> &scalarKernels<double, 3>();
+template const ForceKernels<float, 2> &selectKernels<float, 2>();
+template const ForceKernels<float, 3> &selectKernels<float, 3>();
+template const ForceKernels<double, 2> &selectKernels<double, 2>();
+template const ForceKernels<double, 3> &selectKernels<double, 3>();
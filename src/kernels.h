@@ -0,0 +1,49 @@
+//
+//  kernels.h
+//  layout++
+//
+
+#ifndef __layout____kernels__
+#define __layout____kernels__
+
+#include <cstddef>
+
+// Inner loops of the force computation over contiguous arrays. Each set of
+// kernels is compiled for one instruction set; selectKernels() picks the
+// best one supported by the CPU at runtime, and scalarKernels() is the
+// portable fallback every other set must agree with.
+//
+// Pairs at zero distance contribute nothing. This is done with a mask
+// rather than a branch; it skips the body itself when it is part of the
+// input, and the tree makes sure no two distinct bodies share a spot.
+//
+// Interactions are computed in `Real` (float kernels are twice as wide),
+// while totals are returned in double. Coordinates are passed as `Dim`
+// separate arrays, position[axis][k].
+template <typename Real, int Dim>
+struct ForceKernels {
+  const char *name;
+  size_t width; // number of interactions computed at once
+
+  // Adds sum(mass[k] * (p[k] - point) / |p[k] - point|^3) over k < count
+  // to force[0..Dim).
+  void (*repulsion)(const Real *const *position, const Real *mass, size_t count,
+                    const Real *point, double *force);
+
+  // Adds sum(coeff * (r - length) / r * d) over k < count to force[0..Dim),
+  // where d = p[k] - point and r = |d|: the pull of springs from `point`
+  // to each p[k].
+  void (*springs)(const Real *const *position, size_t count, const Real *point,
+                  Real length, Real coeff, double *force);
+};
+
+// Both functions are available for float and double, in 2 and 3 dimensions.
+template <typename Real, int Dim>
+const ForceKernels<Real, Dim> &scalarKernels();
+// Returns the widest kernels this CPU can run. NGRAPH_KERNELS environment
+// variable (scalar, avx2 or avx512) can force a narrower set; other values
+// are ignored with a warning.
+template <typename Real, int Dim>
+const ForceKernels<Real, Dim> &selectKernels();
+
+#endif /* defined(__layout____kernels__) */
@@ -7,27 +7,48 @@
 //
 
 #include "layout.h"
+#include "checkpoint.h"
 #include <iostream>
 #include <cmath>
 #include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <omp.h>
+
+namespace {
+  // Milliseconds since `start`, which is moved to now.
+  double lap(chrono::steady_clock::time_point &start) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double, milli>(now - start).count();
+    start = now;
+    return elapsed;
+  }
+}
 
-Layout::Layout() :tree(settings) {}
+template <typename Real, int Dim>
+Layout<Real, Dim>::Layout() :iteration(0), tree(settings), barnesHut(settings), multipole(settings), kernels(&selectKernels<Real, Dim>()), speed(0), interactions(0) {}
 
-void Layout::init(int* links, long size) {
-  random = Random(42);
+template <typename Real, int Dim>
+void Layout<Real, Dim>::init(const int *links, long size) {
   initBodies(links, size);
 
   // Now the graph is initialized. Let's make sure we get
   // good initial positions:
-  setDefaultBodiesPositions();
+  if (settings.multilevel) {
+    setMultilevelPositions();
+  } else {
+    setDefaultBodiesPositions();
+  }
 }
 
-void Layout::init(int *links, long linksSize, int *initialPositions, size_t posSize) {
+template <typename Real, int Dim>
+void Layout<Real, Dim>::init(const int *links, long linksSize, const int *initialPositions, size_t posSize) {
   initBodies(links, linksSize);
-  if (bodies.size() * 3 != posSize) {
+  if (bodies.size() * Dim != posSize) {
     cout << "There are " << bodies.size() << " nodes in the graph and " << endl
     << posSize << " positions. It is expected that each body has exactly" << endl
-    << "3 Int32 records in the positions file (x, y, z). However this is not the case" << endl
+    << Dim << " Int32 records in the positions file (one per axis). However this is not the case" << endl
     << "here. Are you sure you are loading correct positions for this graph file?";
     throw "Positions file mismatch";
   }
@@ -35,203 +56,547 @@ void Layout::init(int *links, long linksSize, int *initialPositions, size_t posS
   loadPositionsFromArray(initialPositions);
 }
 
-void Layout::loadPositionsFromArray(int *initialPositions) {
+template <typename Real, int Dim>
+void Layout<Real, Dim>::loadPositionsFromArray(const int *initialPositions) {
   for (size_t i = 0; i < bodies.size(); ++i) {
-    Vector3 initialPos(initialPositions[i * 3 + 0], //+ Random::nextDouble(),
-                       initialPositions[i * 3 + 1], //+ Random::nextDouble(),
-                       initialPositions[i * 3 + 2] //+ Random::nextDouble()
-                       );
-    bodies[i].setPos(initialPos);
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies.pos[axis][i] = initialPositions[i * Dim + axis]; //+ Random::nextDouble()
+    }
   }
 }
 
-void Layout::setDefaultBodiesPositions() {
+template <typename Real, int Dim>
+void Layout<Real, Dim>::setDefaultBodiesPositions() {
+  // Random numbers are keyed by the body they are drawn for, so positions
+  // do not depend on how many numbers were drawn before.
+  CounterRandom initial(settings.seed, InitialPositionStream);
+  CounterRandom offset(settings.seed, NeighbourPositionStream);
   size_t maxBodyId = bodies.size();
   for (size_t i = 0; i < maxBodyId; ++i) {
-    Body *body = &(bodies[i]);
-    if (!body->positionInitialized()) {
-      Vector3 initialPos(random.nextDouble() * log(maxBodyId) * 100,
-                         random.nextDouble() * log(maxBodyId) * 100,
-                         random.nextDouble() * log(maxBodyId) * 100);
-      bodies[i].setPos(initialPos);
-    }
-    Vector3 *sourcePos = &(body->pos);
+    if (!bodies.positionInitialized(i)) {
+      for (int axis = 0; axis < Dim; ++axis) {
+        bodies.pos[axis][i] = initial.nextDouble(i, 0, axis) * log(maxBodyId) * 100;
+      }
+    }
     // init neighbors position:
-    for (size_t j = 0; j < body->springs.size(); ++j) {
-      if (!bodies[body->springs[j]].positionInitialized()) {
-        Vector3 neighbourPosition(
-                                  sourcePos->x + random.next(settings.springLength) - settings.springLength/2,
-                                  sourcePos->y + random.next(settings.springLength) - settings.springLength/2,
-                                  sourcePos->z + random.next(settings.springLength) - settings.springLength/2
-                                  );
-        bodies[j].setPos(neighbourPosition);
+    const int *neighbours = graph.springs(i);
+    for (size_t j = 0; j < graph.degree(i); ++j) {
+      if (!bodies.positionInitialized(neighbours[j])) {
+        for (int axis = 0; axis < Dim; ++axis) {
+          bodies.pos[axis][neighbours[j]] = bodies.pos[axis][i] +
+            offset.nextDouble(neighbours[j], 0, axis) * settings.springLength - settings.springLength/2;
+        }
       }
     }
   }
 }
 
-void Layout::initBodies(int* links, long size) {
-  // FIXME: If there are no links in a graph, it will fail
-  int from = 0;
-  int maxBodyId = 0;
+// Lays out the coarser graph (recursively, until it is small enough or stops
+// shrinking), then puts every body next to its coarse body. Returns false,
+// with default positions set, if the graph was not coarsened.
+template <typename Real, int Dim>
+bool Layout<Real, Dim>::setMultilevelPositions() {
+  if (bodies.size() <= settings.coarsestSize) {
+    setDefaultBodiesPositions();
+    return false;
+  }
 
-  // since we can have holes in the original list - let's
-  // figure out max node id, and then initialize bodies
-  for (int i = 0; i < size; i++) {
-    int index = *(links + i);
+  vector<double> weight(bodies.mass.begin(), bodies.mass.end());
+  vector<int> parent, links;
+  size_t coarseCount = graph.coarsen(weight, parent, links);
+  // Mostly isolated bodies: collapsing them saves nothing.
+  if (coarseCount * 10 > bodies.size() * 9) {
+    setDefaultBodiesPositions();
+    return false;
+  }
 
-    if (index < 0) {
-      index = -index;
-      from = index - 1;
-      if (from > maxBodyId) maxBodyId = from;
-    } else {
-      int to = index - 1;
-      if (to > maxBodyId) maxBodyId = to;
-    }
+  // A coarse body is as heavy as the bodies it stands for, so the coarse
+  // graph takes about as much space as the whole one.
+  Layout<Real, Dim> coarse;
+  coarse.settings = settings;
+  coarse.initBodies(links.data(), links.size());
+  vector<int>().swap(links);
+  fill(coarse.bodies.mass.begin(), coarse.bodies.mass.end(), 0);
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    coarse.bodies.mass[parent[i]] += bodies.mass[i];
   }
 
-  bodies.reserve(maxBodyId + 1);
-  for (int i = 0; i < maxBodyId + 1; ++i) {
-    bodies.push_back(Body());
+  int steps = coarse.setMultilevelPositions() ? settings.refineSteps : settings.coarsestSteps;
+  for (int i = 0; i < steps; ++i) {
+    if (coarse.step()) break;
   }
 
-  // Now that we have bodies, let's add links:
-  Body *fromBody = nullptr;
-  for (int i = 0; i < size; i++) {
-    int index = *(links + i);
-    if (index < 0) {
-      index = -index;
-      from = index - 1;
-      fromBody = &(bodies[from]);
-    } else {
-      int to = index - 1;
-      fromBody->springs.push_back(to);
-      bodies[to].incomingCount += 1;
+  CounterRandom offset(settings.seed, MultilevelStream);
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies.pos[axis][i] = coarse.bodies.pos[axis][parent[i]] +
+        offset.nextDouble(i, coarseCount, axis) * settings.springLength - settings.springLength/2;
     }
   }
+  return true;
+}
 
-  // Finally, update body mass based on total number of neighbors:
+template <typename Real, int Dim>
+void Layout<Real, Dim>::initBodies(const int *links, long size) {
+  // Threads are pinned before bodies are first touched, so that pages stay
+  // with the threads that use them.
+  if (settings.numa) pinThreads();
+  iteration = 0;
+  speed = 0;
+  timings = StepTimings();
+  newBodies.clear();
+  graph.build(links, size);
+  // A layout can be initialized again with another graph (see BatchLayout):
+  // bodies start from scratch, in the memory of the previous ones.
+  bodies.resize(0);
+  bodies.resize(graph.size());
+  tree.reset();
+
+  // Update body mass based on total number of neighbors:
   for (size_t i = 0; i < bodies.size(); i++) {
-    Body *body = &(bodies[i]);
-    body->mass = 1 + (body->springs.size() + body->incomingCount)/3.0;
+    bodies.mass[i] = 1 + (graph.degree(i) + graph.incomingCount[i])/3.0;
   }
 }
 
-void Layout::setBodiesWeight(int *weights) {
+template <typename Real, int Dim>
+void Layout<Real, Dim>::setBodiesWeight(const int *weights) {
     // FIXME: Verify that size of the weights matches size of the bodies.
     // Unfortunately current graph format does not properly store nodes without
     // edges.
     for (size_t i = 0; i < bodies.size(); i++) {
-        Body *body = &(bodies[i]);
-        body->mass = weights[i];
+        bodies.mass[i] = weights[i];
     }
 }
 
-size_t Layout::getBodiesCount() {
-  return bodies.size();
+namespace {
+  // Arrays of a checkpoint, in the order they are stored.
+  template <typename Real, int Dim>
+  vector<typename BodyStore<Real, Dim>::Array *> checkpointArrays(BodyStore<Real, Dim> &bodies) {
+    vector<typename BodyStore<Real, Dim>::Array *> arrays;
+    for (int axis = 0; axis < Dim; ++axis) arrays.push_back(&bodies.pos[axis]);
+    for (int axis = 0; axis < Dim; ++axis) arrays.push_back(&bodies.velocity[axis]);
+    for (int axis = 0; axis < Dim; ++axis) arrays.push_back(&bodies.force[axis]);
+    for (int axis = 0; axis < Dim; ++axis) arrays.push_back(&bodies.previousForce[axis]);
+    arrays.push_back(&bodies.mass);
+    return arrays;
+  }
 }
 
-bool Layout::step() {
-  accumulate();
-  double totalMovement = integrate();
-  cout << totalMovement << " move" << endl;
-  return totalMovement < settings.stableThreshold;
+template <typename Real, int Dim>
+void Layout<Real, Dim>::saveCheckpoint(const char *fileName) {
+  applyGraphChanges();
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, checkpointMagic, sizeof(checkpointMagic));
+  header.version = checkpointVersion;
+  header.dimensions = Dim;
+  header.realSize = sizeof(Real);
+  header.bodyCount = bodies.size();
+  header.fingerprint = graph.fingerprint();
+  header.seed = settings.seed;
+  header.iteration = iteration;
+  header.speed = speed;
+
+  vector<typename BodyStore<Real, Dim>::Array *> arrays = checkpointArrays(bodies);
+  vector<const void *> data;
+  for (size_t i = 0; i < arrays.size(); ++i) data.push_back(arrays[i]->data());
+  header.arrayCount = data.size();
+  writeCheckpoint(fileName, header, data);
+}
+
+template <typename Real, int Dim>
+void Layout<Real, Dim>::resume(const int *links, long size, const char *checkpointFileName) {
+  CheckpointFile checkpoint(checkpointFileName);
+  const CheckpointHeader &header = checkpoint.getHeader();
+  if (header.dimensions != Dim || header.realSize != sizeof(Real)) {
+    throw "Checkpoint was saved by a layout of another precision or dimension";
+  }
+
+  initBodies(links, size);
+  if (header.bodyCount != bodies.size() || header.fingerprint != graph.fingerprint()) {
+    throw "Checkpoint was saved for another graph";
+  }
+  vector<typename BodyStore<Real, Dim>::Array *> arrays = checkpointArrays(bodies);
+  if (header.arrayCount != arrays.size()) throw "Checkpoint has unexpected arrays";
+
+  // Every thread copies one contiguous part of all arrays, about the part
+  // it touched first in bodies.resize().
+  size_t count = bodies.size();
+  #pragma omp parallel
+  {
+    size_t threads = omp_get_num_threads(), thread = omp_get_thread_num();
+    size_t begin = count * thread / threads, end = count * (thread + 1) / threads;
+    for (size_t a = 0; a < arrays.size(); ++a) {
+      memcpy(arrays[a]->data() + begin, (const Real *)checkpoint.array(a) + begin, (end - begin) * sizeof(Real));
+    }
+  }
+
+  iteration = header.iteration;
+  settings.seed = header.seed;
+  speed = header.speed;
+}
+
+template <typename Real, int Dim>
+void Layout<Real, Dim>::updateBodyMass(int body) {
+  bodies.mass[body] = 1 + graph.linkCount(body)/3.0;
+}
+
+template <typename Real, int Dim>
+int Layout<Real, Dim>::addNode() {
+  int id = graph.addNode();
+  bodies.resize(graph.nodeCount());
+  newBodies.push_back(id);
+  return id;
+}
+
+template <typename Real, int Dim>
+void Layout<Real, Dim>::addLink(int from, int to) {
+  graph.addLink(from, to);
+  updateBodyMass(from);
+  updateBodyMass(to);
+}
+
+template <typename Real, int Dim>
+bool Layout<Real, Dim>::removeLink(int from, int to) {
+  if (!graph.removeLink(from, to)) return false;
+  updateBodyMass(from);
+  updateBodyMass(to);
+  return true;
+}
+
+template <typename Real, int Dim>
+int Layout<Real, Dim>::removeNode(int id) {
+  if (id < 0 || (size_t)id >= graph.nodeCount()) throw "Node does not exist";
+  // Links of the removed body change masses of its neighbours. They are
+  // collected before the graph renames anything.
+  vector<int> neighbours = graph.linkedBodies(id);
+
+  int last = graph.removeNode(id);
+  for (int axis = 0; axis < Dim; ++axis) {
+    bodies.pos[axis][id] = bodies.pos[axis][last];
+    bodies.velocity[axis][id] = bodies.velocity[axis][last];
+    bodies.force[axis][id] = bodies.force[axis][last];
+    bodies.previousForce[axis][id] = bodies.previousForce[axis][last];
+  }
+  bodies.mass[id] = bodies.mass[last];
+  bodies.resize(last);
+
+  newBodies.erase(remove(newBodies.begin(), newBodies.end(), id), newBodies.end());
+  replace(newBodies.begin(), newBodies.end(), last, id);
+  for (size_t i = 0; i < neighbours.size(); ++i) {
+    int body = neighbours[i] == last ? id : neighbours[i];
+    if (neighbours[i] != id && body < last) updateBodyMass(body);
+  }
+  return last;
+}
+
+template <typename Real, int Dim>
+void Layout<Real, Dim>::applyGraphChanges() {
+  graph.commit();
+  if (newBodies.empty()) return;
+
+  // New bodies go next to their placed neighbours, with the same offsets
+  // init() uses. Bodies without placed neighbours get a random position.
+  sort(newBodies.begin(), newBodies.end());
+  CounterRandom initial(settings.seed, InitialPositionStream);
+  CounterRandom offset(settings.seed, NeighbourPositionStream);
+  for (size_t k = 0; k < newBodies.size(); ++k) {
+    int body = newBodies[k];
+    double center[Dim] = {};
+    int placed = 0;
+    const int *neighbours = graph.neighbours(body);
+    for (size_t j = 0; j < graph.neighbourCount(body); ++j) {
+      if (!bodies.positionInitialized(neighbours[j])) continue;
+      for (int axis = 0; axis < Dim; ++axis) center[axis] += bodies.pos[axis][neighbours[j]];
+      placed += 1;
+    }
+    for (int axis = 0; axis < Dim; ++axis) {
+      if (placed > 0) {
+        bodies.pos[axis][body] = center[axis] / placed +
+          offset.nextDouble(body, iteration, axis) * settings.springLength - settings.springLength/2;
+      } else {
+        bodies.pos[axis][body] = initial.nextDouble(body, iteration, axis) * log(bodies.size()) * 100;
+      }
+    }
+  }
+  newBodies.clear();
+}
+
+template <typename Real, int Dim>
+size_t Layout<Real, Dim>::getBodiesCount() {
+  return bodies.size();
 }
 
-void Layout::accumulate() {
-  tree.insertBodies(bodies);
+template <typename Real, int Dim>
+vector<Body> *Layout<Real, Dim>::getBodies() {
+  applyGraphChanges();
+  bodiesView.resize(bodies.size());
 
   #pragma omp parallel for
   for (size_t i = 0; i < bodies.size(); i++) {
-    Body* body = &bodies[i];
-    body->force.reset();
-
-    tree.updateBodyForce(&(*body));
-    updateDragForce(&(*body));
+    Body &body = bodiesView[i];
+    double velocity[3] = { 0, 0, 0 }, force[3] = { 0, 0, 0 };
+    for (int axis = 0; axis < Dim; ++axis) {
+      velocity[axis] = bodies.velocity[axis][i];
+      force[axis] = bodies.force[axis][i];
+    }
+    body.setPos(bodies.getPos(i));
+    body.velocity = Vector3(velocity[0], velocity[1], velocity[2]);
+    body.force = Vector3(force[0], force[1], force[2]);
+    body.mass = bodies.mass[i];
+    body.incomingCount = graph.incomingCount[i];
   }
 
+  return &bodiesView;
+}
+
+template <typename Real, int Dim>
+void Layout<Real, Dim>::getPositions(int *positions) {
   #pragma omp parallel for
   for (size_t i = 0; i < bodies.size(); i++) {
-    Body* body = &bodies[i];
-    updateSpringForce(&(*body));
+    for (int axis = 0; axis < Dim; ++axis) {
+      positions[i * Dim + axis] = floor(bodies.pos[axis][i] + 0.5);
+    }
   }
 }
 
-double Layout::integrate() {
-  double dx = 0, tx = 0,
-  dy = 0, ty = 0,
-  dz = 0, tz = 0,
-  timeStep = settings.timeStep;
+template <typename Real, int Dim>
+bool Layout<Real, Dim>::step() {
+  applyGraphChanges();
+  if (!metricsCallback) {
+    accumulate();
+    double totalMovement = integrate();
+    iteration += 1;
+    return totalMovement < settings.stableThreshold;
+  }
 
-//dx should be private or defined inside loop
- //tx need to be reduction variable, or its value will be unpredictable.
-  #pragma omp parallel for reduction(+:tx,ty,tz) private(dx,dy,dz)
-  for (size_t i = 0; i < bodies.size(); i++) {
-    Body* body = &bodies[i];
-    double coeff = timeStep / body->mass;
+  StepTimings before = timings;
+  size_t refits = tree.getStats().refits;
+  accumulate();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  double totalMovement = integrate();
+  timings.integrate += lap(start);
+
+  StepMetrics metrics;
+  metrics.step = iteration;
+  metrics.timings.tree = timings.tree - before.tree;
+  metrics.timings.repulsion = timings.repulsion - before.repulsion;
+  metrics.timings.springs = timings.springs - before.springs;
+  metrics.timings.integrate = timings.integrate - before.integrate;
+  metrics.treeNodes = tree.getNodes().size();
+  // An empty tree has no levels, a single body only the root.
+  size_t levels = tree.getLevelStart().size();
+  metrics.treeDepth = levels > 1 ? levels - 2 : 0;
+  metrics.treeRefitted = tree.getStats().refits != refits;
+  metrics.interactionsPerBody = bodies.size() > 0 ? (double)interactions / bodies.size() : 0;
+  metrics.movement = totalMovement;
+  metricsCallback(metrics);
+  iteration += 1;
+  return totalMovement < settings.stableThreshold;
+}
 
-    body->velocity.x += coeff * body->force.x;
-    body->velocity.y += coeff * body->force.y;
-    body->velocity.z += coeff * body->force.z;
+template <typename Real, int Dim>
+RepulsionEngine<Real, Dim> *Layout<Real, Dim>::repulsion() {
+  if (settings.repulsion == RepulsionMethod::Multipole) return &multipole;
+  return &barnesHut;
+}
+
+template <typename Real, int Dim>
+void Layout<Real, Dim>::accumulate() {
+  // Phases are only timed for metrics, see setMetricsCallback().
+  bool timed = (bool)metricsCallback;
+  chrono::steady_clock::time_point start;
+  if (timed) start = chrono::steady_clock::now();
+  tree.insertBodies(bodies, iteration);
+  if (timed) timings.tree += lap(start);
+  interactions = repulsion()->updateForces(tree, bodies);
+  if (timed) timings.repulsion += lap(start);
+
+  // The adaptive integrator damps bodies by itself.
+  if (settings.integrator == Integrator::Velocity) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < bodies.size(); i++) {
+      updateDragForce(i);
+    }
+  }
 
-    double vx = body->velocity.x,
-    vy = body->velocity.y,
-    vz = body->velocity.z,
-    v = sqrt(vx * vx + vy * vy + vz * vz);
+  #pragma omp parallel
+  {
+    SpringBatch<Real, Dim> batch;
 
-    if (v > 1) {
-      body->velocity.x = vx / v;
-      body->velocity.y = vy / v;
-      body->velocity.z = vz / v;
+    #pragma omp for
+    for (size_t i = 0; i < bodies.size(); i++) {
+      updateSpringForce(i, batch);
     }
+  }
+  if (timed) timings.springs += lap(start);
+}
+
+template <typename Real, int Dim>
+double Layout<Real, Dim>::integrate() {
+  if (settings.integrator == Integrator::Adaptive) return integrateAdaptive();
+  double timeStep = settings.timeStep;
 
-    dx = timeStep * body->velocity.x;
-    dy = timeStep * body->velocity.y;
-    dz = timeStep * body->velocity.z;
+  // Movement is summed per fixed block of bodies, then over blocks in
+  // order, so the total (and thus when the layout stops) does not depend
+  // on the number of threads.
+  const size_t blockSize = 4096;
+  size_t blocks = (bodies.size() + blockSize - 1) / blockSize;
+  movement.assign(blocks * Dim, 0);
+
+  #pragma omp parallel for
+  for (size_t block = 0; block < blocks; ++block) {
+    double *total = &movement[block * Dim];
+    size_t end = min(bodies.size(), (block + 1) * blockSize);
+    for (size_t i = block * blockSize; i < end; i++) {
+      double coeff = timeStep / bodies.mass[i];
+
+      double velocity[Dim], v = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        velocity[axis] = bodies.velocity[axis][i] + coeff * bodies.force[axis][i];
+        v += velocity[axis] * velocity[axis];
+      }
+      v = sqrt(v);
 
-    body->pos.x += dx;
-    body->pos.y += dy;
-    body->pos.z += dz;
+      for (int axis = 0; axis < Dim; ++axis) {
+        if (v > 1) velocity[axis] = velocity[axis] / v;
+        bodies.velocity[axis][i] = velocity[axis];
 
-    tx += abs(dx); ty += abs(dy); tz += abs(dz);
+        double d = timeStep * velocity[axis];
+        bodies.pos[axis][i] += d;
+        total[axis] += abs(d);
+      }
+    }
   }
 
-  return (tx * tx + ty * ty + tz * tz)/bodies.size();
+  double total[Dim] = {};
+  for (size_t block = 0; block < blocks; ++block) {
+    for (int axis = 0; axis < Dim; ++axis) total[axis] += movement[block * Dim + axis];
+  }
+  double result = 0;
+  for (int axis = 0; axis < Dim; ++axis) result += total[axis] * total[axis];
+  return result/bodies.size();
 }
 
-void Layout::updateDragForce(Body *body) {
-  body->force.x -= settings.dragCoeff * body->velocity.x;
-  body->force.y -= settings.dragCoeff * body->velocity.y;
-  body->force.z -= settings.dragCoeff * body->velocity.z;
+namespace {
+  // Swing and traction of a body, in units of length: how much and how
+  // consistently it would move from rest under this and the previous force.
+  template <typename Real, int Dim>
+  void measureSwing(const BodyStore<Real, Dim> &bodies, size_t i, double scale,
+                    double &swing, double &traction) {
+    double s = 0, t = 0;
+    for (int axis = 0; axis < Dim; ++axis) {
+      double current = bodies.force[axis][i], previous = bodies.previousForce[axis][i];
+      s += (current - previous) * (current - previous);
+      t += (current + previous) * (current + previous);
+    }
+    swing = scale * sqrt(s);
+    traction = scale * sqrt(t) / 2;
+  }
 }
 
-void Layout::updateSpringForce(Body *source) {
+// ForceAtlas2-like integration. A body would move by timeStep^2 * F / m
+// from rest. The global speed is set so that the total swing is
+// swingTolerance times the total traction; it grows by at most half per
+// step. Every body then scales it down by its own swing (in units of
+// springLength), and moves at most timeStep per step.
+template <typename Real, int Dim>
+double Layout<Real, Dim>::integrateAdaptive() {
+  double timeStep = settings.timeStep;
+  const size_t blockSize = 4096;
+  size_t blocks = (bodies.size() + blockSize - 1) / blockSize;
+  movement.assign(blocks * Dim, 0);
+  balance.assign(blocks * 2, 0);
 
-  Body *body1 = source;
-  for (size_t i = 0; i < source->springs.size(); ++i){
-    Body *body2 = &(bodies[source->springs[i]]);
+  #pragma omp parallel for
+  for (size_t block = 0; block < blocks; ++block) {
+    size_t end = min(bodies.size(), (block + 1) * blockSize);
+    for (size_t i = block * blockSize; i < end; i++) {
+      double swing, traction;
+      measureSwing(bodies, i, timeStep * timeStep / bodies.mass[i], swing, traction);
+      balance[block * 2] += bodies.mass[i] * swing;
+      balance[block * 2 + 1] += bodies.mass[i] * traction;
+    }
+  }
 
-    double dx = body2->pos.x - body1->pos.x;
-    double dy = body2->pos.y - body1->pos.y;
-    double dz = body2->pos.z - body1->pos.z;
-    double r = sqrt(dx * dx + dy * dy + dz * dz);
+  double swing = 0, traction = 0;
+  for (size_t block = 0; block < blocks; ++block) {
+    swing += balance[block * 2];
+    traction += balance[block * 2 + 1];
+  }
+  double target = swing > 0 ? settings.swingTolerance * traction / swing : 1;
+  speed = speed > 0 ? min(target, speed * 1.5) : target;
 
-    if (r == 0) {
-      dx = (random.nextDouble() - 0.5) / 50;
-      dy = (random.nextDouble() - 0.5) / 50;
-      dz = (random.nextDouble() - 0.5) / 50;
-      r = sqrt(dx * dx + dy * dy + dz * dz);
+  #pragma omp parallel for
+  for (size_t block = 0; block < blocks; ++block) {
+    double *total = &movement[block * Dim];
+    size_t end = min(bodies.size(), (block + 1) * blockSize);
+    for (size_t i = block * blockSize; i < end; i++) {
+      double scale = timeStep * timeStep / bodies.mass[i];
+      double bodySwing, bodyTraction;
+      measureSwing(bodies, i, scale, bodySwing, bodyTraction);
+      double bodySpeed = speed / (1 + speed * bodySwing / settings.springLength);
+
+      double d[Dim], length = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        d[axis] = bodySpeed * scale * bodies.force[axis][i];
+        length += d[axis] * d[axis];
+      }
+      length = sqrt(length);
+
+      for (int axis = 0; axis < Dim; ++axis) {
+        if (length > timeStep) d[axis] *= timeStep / length;
+        bodies.pos[axis][i] += d[axis];
+        bodies.velocity[axis][i] = d[axis] / timeStep;
+        bodies.previousForce[axis][i] = bodies.force[axis][i];
+        total[axis] += abs(d[axis]);
+      }
     }
+  }
 
-    double d = r - settings.springLength;
-    double coeff = settings.springCoeff * d / r;
+  double total[Dim] = {};
+  for (size_t block = 0; block < blocks; ++block) {
+    for (int axis = 0; axis < Dim; ++axis) total[axis] += movement[block * Dim + axis];
+  }
+  double result = 0;
+  for (int axis = 0; axis < Dim; ++axis) result += total[axis] * total[axis];
+  return result/bodies.size();
+}
 
-    body1->force.x += coeff * dx;
-    body1->force.y += coeff * dy;
-    body1->force.z += coeff * dz;
+template <typename Real, int Dim>
+void Layout<Real, Dim>::updateDragForce(size_t body) {
+  for (int axis = 0; axis < Dim; ++axis) {
+    bodies.force[axis][body] -= settings.dragCoeff * bodies.velocity[axis][body];
+  }
+}
 
-    body2->force.x -= coeff * dx;
-    body2->force.y -= coeff * dy;
-    body2->force.z -= coeff * dz;
+template <typename Real, int Dim>
+void Layout<Real, Dim>::updateSpringForce(size_t body, SpringBatch<Real, Dim> &batch) {
+  // Springs are listed at both of their ends, so the body only sums forces
+  // acting on itself and threads never write to the same body.
+  const int *neighbours = graph.neighbours(body);
+  size_t count = graph.neighbourCount(body);
+  batch.resize(count);
+  const Real *position[Dim];
+  Real point[Dim];
+  for (int axis = 0; axis < Dim; ++axis) {
+    for (size_t i = 0; i < count; ++i) {
+      batch.pos[axis][i] = bodies.pos[axis][neighbours[i]];
+    }
+    position[axis] = batch.pos[axis].data();
+    point[axis] = bodies.pos[axis][body];
+  }
+
+  double force[Dim] = {};
+  kernels->springs(position, count, point, (Real)settings.springLength,
+                   (Real)settings.springCoeff, force);
+
+  for (int axis = 0; axis < Dim; ++axis) {
+    bodies.force[axis][body] += force[axis];
   }
 }
+
+template class Layout<float, 2>;
+template class Layout<float, 3>;
+template class Layout<double, 2>;
+template class Layout<double, 3>;
@@ -10,36 +10,150 @@
 #define __layout____layout__
 
 #include <vector>
+#include <functional>
 #include "primitives.h"
+#include "graph.h"
 #include "quadTree.h"
+#include "repulsion.h"
+#include "multipole.h"
+#include "kernels.h"
 #include "Random.h"
 
 using namespace std;
 
+// Neighbour positions of one body, gathered so that ForceKernels::springs
+// gets contiguous input.
+template <typename Real, int Dim>
+struct SpringBatch {
+  vector<Real> pos[Dim];
+
+  void resize(size_t count) {
+    for (int axis = 0; axis < Dim; ++axis) pos[axis].resize(count);
+  }
+};
+
+// Milliseconds spent in each phase of step(), summed since init(). Layout
+// only times steps taken while a metrics callback is set.
+struct StepTimings {
+  double tree = 0;      // building or refitting the tree
+  double repulsion = 0;
+  double springs = 0;   // springs and drag
+  double integrate = 0;
+};
+
+// What happened during one step(), see Layout::setMetricsCallback().
+struct StepMetrics {
+  size_t step;                // steps since init(), this one excluded
+  StepTimings timings;        // of this step only
+  size_t treeNodes;
+  size_t treeDepth;           // levels below the root
+  bool treeRefitted;          // see LayoutSettings::treeRefit
+  double interactionsPerBody; // bodies and cells a body was repelled by
+  double movement;            // compared with LayoutSettings::stableThreshold
+};
+
+// Force directed layout of a graph. `Real` (float or double) is the type of
+// the simulation state: float halves memory traffic and doubles the width
+// of force kernels, which is enough when positions are rounded to integers
+// in the end anyway. Settings and everything handed out (Body, Vector3)
+// stay double.
+//
+// `Dim` (2 or 3) is the number of dimensions of the layout. It is fixed at
+// compile time, so a 2D layout builds a quadtree, stores two coordinates
+// per body and does no work on a third axis. Bodies handed out by a 2D
+// layout have z = 0.
+template <typename Real = double, int Dim = 3>
 class Layout {
-  Random random;
-  vector<Body> bodies;
+  size_t iteration; // number of steps since init()
+  BodyStore<Real, Dim> bodies;
+  Graph graph;
+  vector<Body> bodiesView; // AoS copy handed out by getBodies()
   LayoutSettings settings;
-  QuadTree tree;
+  QuadTree<Real, Dim> tree;
+  BarnesHut<Real, Dim> barnesHut;
+  Multipole<Real, Dim> multipole;
+  const ForceKernels<Real, Dim> *kernels;
+  vector<double> movement; // per block of bodies, see integrate()
+  vector<double> balance;  // swing and traction per block of bodies
+  double speed;            // global speed of Integrator::Adaptive
+  StepTimings timings;
+  size_t interactions;     // of the last repulsion pass
+  function<void(const StepMetrics &)> metricsCallback;
+  vector<int> newBodies;   // added since the last step, not placed yet
   
+  RepulsionEngine<Real, Dim> *repulsion();
   void accumulate();
   double integrate();
-  void updateDragForce(Body *body);
-  void updateSpringForce(Body *spring);
+  double integrateAdaptive();
+  void updateDragForce(size_t body);
+  void updateSpringForce(size_t body, SpringBatch<Real, Dim> &batch);
 
-  void initBodies(int *links, long size);
+  void initBodies(const int *links, long size);
 
   void setDefaultBodiesPositions();
-  void loadPositionsFromArray(int *initialPositions);
+  bool setMultilevelPositions();
+  void applyGraphChanges();
+  void updateBodyMass(int body);
+  void loadPositionsFromArray(const int *initialPositions);
   
 public:
   Layout();
-  void init(int *links, long linksSize, int *initialPositions, size_t posSize);
-  void init(int *links, long size);
-  void setBodiesWeight(int *weights);
+  // `initialPositions` holds `Dim` coordinates per body.
+  void init(const int *links, long linksSize, const int *initialPositions, size_t posSize);
+  // Links are read only during init(), nothing is copied or kept, so they
+  // can come straight from a MappedFile.
+  void init(const int *links, long size);
+  void setBodiesWeight(const int *weights);
+  // Writes the whole simulation state into one file: positions,
+  // velocities, forces and masses as they are in memory, the step and the
+  // random seed, and a fingerprint of the graph. Pending graph changes are
+  // applied first.
+  void saveCheckpoint(const char *fileName);
+  // Builds the graph as init() does and continues from a checkpoint of the
+  // same graph, mapped and copied in bulk. With the same settings, the
+  // following steps are exactly those the saved layout would have taken
+  // (but for treeRefit: the first step rebuilds the tree, as after init(),
+  // where the saved layout may have refitted it). Settings are not saved,
+  // except the seed.
+  void resume(const int *links, long size, const char *checkpointFileName);
+
+  // Changes the graph of a running layout. Changes take effect on the next
+  // step(), which continues from the current positions: new bodies are
+  // placed next to their neighbours, everything else stays where it is.
+  // Masses of the bodies whose links change are recomputed from their
+  // number of links, as init() does.
+  int addNode();
+  void addLink(int from, int to);
+  bool removeLink(int from, int to);
+  // The last body takes the id of the removed one; returns its old id.
+  int removeNode(int id);
+
   bool step();
   size_t getBodiesCount();
-  vector<Body> *getBodies() { return &bodies; };
+  // Settings are read on every step, so they can be tuned between steps.
+  LayoutSettings *getSettings() { return &settings; }
+  // How many steps rebuilt the tree and how many refitted it.
+  const TreeStats &getTreeStats() const { return tree.getStats(); }
+  const StepTimings &getTimings() const { return timings; }
+  // Calls `callback` at the end of every step. Metrics (and getTimings())
+  // are only put together while a callback is set, so that steps without
+  // one read no clocks; pass nullptr to remove it.
+  void setMetricsCallback(function<void(const StepMetrics &)> callback) { metricsCallback = callback; }
+  // Returns an array-of-structures snapshot of the current bodies. The
+  // simulation itself runs on the structure-of-arrays store, so changes made
+  // through this vector are not seen by the layout.
+  vector<Body> *getBodies();
+  // Writes positions rounded to integers, `Dim` per body, into `positions`:
+  // the format init() reads initial positions from.
+  void getPositions(int *positions);
+  // The arrays the simulation runs on, getBodiesCount() values each, with
+  // no copy: step() moves bodies in place. A pointer stays valid until the
+  // number of bodies changes (init(), addNode(), removeNode()).
+  const Real *getPositionArray(int axis) const { return bodies.pos[axis].data(); }
+  const Real *getMassArray() const { return bodies.mass.data(); }
 };
 
+template <typename Real = double>
+using Layout2D = Layout<Real, 2>;
+
 #endif /* defined(__layout____layout__) */
@@ -0,0 +1,39 @@
+//
+//  mappedFile.cpp
+//  layout++
+//
+
+#include "mappedFile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char *fileName) : address(NULL), length(0) {
+  int file = open(fileName, O_RDONLY);
+  if (file < 0) throw "Could not open file";
+
+  struct stat info;
+  if (fstat(file, &info) != 0) {
+    close(file);
+    throw "Could not read file size";
+  }
+  length = (size_t)info.st_size;
+
+  // Empty files cannot be mapped, and have no records anyway.
+  if (length > 0) {
+    address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    if (address == MAP_FAILED) {
+      close(file);
+      throw "Could not map file";
+    }
+    // The file is scanned front to back: ask for aggressive read ahead.
+    madvise(address, length, MADV_SEQUENTIAL);
+  }
+  // The mapping keeps its own reference to the file.
+  close(file);
+}
+
+MappedFile::~MappedFile() {
+  if (address != NULL) munmap(address, length);
+}
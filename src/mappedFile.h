@@ -0,0 +1,34 @@
+//
+//  mappedFile.h
+//  layout++
+//
+
+#ifndef __layout____mappedFile__
+#define __layout____mappedFile__
+
+#include <cstddef>
+
+// Read-only memory mapping of a file of Int32 records (links.bin,
+// positions, weights). Pages are loaded by the OS as they are touched, so
+// opening a file costs nothing, and data() can be handed to Layout::init()
+// without copying. The mapping lives as long as the object.
+class MappedFile {
+  void *address;
+  size_t length; // in bytes
+
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+public:
+  // Throws when the file cannot be opened or mapped.
+  MappedFile(const char *fileName);
+  ~MappedFile();
+
+  const int *data() const { return (const int *)address; }
+  // Number of Int32 records in the file.
+  long size() const { return (long)(length / sizeof(int)); }
+  // The file as bytes, for files of other records (see CheckpointFile).
+  const char *bytes() const { return (const char *)address; }
+  size_t byteSize() const { return length; }
+};
+
+#endif /* defined(__layout____mappedFile__) */
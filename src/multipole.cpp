@@ -0,0 +1,476 @@
+//
+//  multipole.cpp
+//  layout++
+//
+//  Cartesian expansions of the 1/r potential. With y = x_j - c (body
+//  relative to the expansion center), multipole coefficients of a cell are
+//
+//    M(a, b, c) = sum(m_j * y.x^a * y.y^b * y.z^c)
+//
+//  and the potential far away from the cell is sum((-1)^|k| * M(k) * D(k)),
+//  where D(k) = d^k(1/r) / k! are Taylor coefficients of 1/r. They follow
+//  the recurrence
+//
+//    |k| r^2 D(k) = -(2|k| - 1) sum_i(r_i D(k - e_i)) - (|k| - 1) sum_i(D(k - 2e_i))
+//
+
+#include "multipole.h"
+#include <cmath>
+#include <algorithm>
+
+namespace {
+  const int maxOrder = 10;
+  // Cells with at most this many bodies are leaves of the expansion tree.
+  const int leafSize = 64;
+  // One extra slot for the zero term (see Multipole::lowered).
+  const int maxTerms = (maxOrder + 1) * (maxOrder + 2) * (maxOrder + 3) / 6 + 1;
+
+  double binomial(int n, int k) {
+    double result = 1;
+    for (int i = 1; i <= k; ++i) {
+      result = result * (n - k + i) / i;
+    }
+    return result;
+  }
+}
+
+template <typename Real, int Dim>
+Multipole<Real, Dim>::Multipole(const LayoutSettings &_settings) :
+  settings(&_settings), kernels(&selectKernels<Real, Dim>()), tree(NULL), bodies(NULL), order(-1), termCount(0) {}
+
+template <typename Real, int Dim>
+int Multipole<Real, Dim>::term(const int *power) const {
+  int index = 0;
+  for (int axis = 0; axis < Dim; ++axis) index = index * (order + 1) + power[axis];
+  return termIndex[index];
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::prepare(int expansionOrder) {
+  order = expansionOrder;
+  int indexCount = 1;
+  for (int axis = 0; axis < Dim; ++axis) indexCount *= order + 1;
+
+  // Terms of each degree go in descending order of their powers: (2, 0, 0),
+  // (1, 1, 0), (1, 0, 1), (0, 2, 0)... which is descending order of the
+  // flat index.
+  powers.clear();
+  termIndex.assign(indexCount, -1);
+  termCount = 0;
+  for (int n = 0; n <= order; ++n) {
+    for (int index = indexCount - 1; index >= 0; --index) {
+      int p[Dim], degree = 0;
+      for (int axis = Dim - 1, rest = index; axis >= 0; --axis, rest /= order + 1) {
+        p[axis] = rest % (order + 1);
+        degree += p[axis];
+      }
+      if (degree != n) continue;
+      termIndex[index] = (int)termCount;
+      powers.insert(powers.end(), p, p + Dim);
+      termCount += 1;
+    }
+  }
+
+  lowered.resize(termCount * Dim);
+  loweredTwice.resize(termCount * Dim);
+  for (size_t t = 0; t < termCount; ++t) {
+    const int *p = &powers[t * Dim];
+    for (int i = 0; i < Dim; ++i) {
+      int q[Dim];
+      std::copy(p, p + Dim, q);
+      q[i] -= 1;
+      lowered[t * Dim + i] = p[i] > 0 ? term(q) : (int)termCount;
+      q[i] -= 1;
+      loweredTwice[t * Dim + i] = p[i] > 1 ? term(q) : (int)termCount;
+    }
+  }
+
+  shiftTable.clear();
+  translationTable.clear();
+  for (int k = 0; k < Dim; ++k) gradientTable[k].clear();
+
+  for (size_t to = 0; to < termCount; ++to) {
+    const int *a = &powers[to * Dim];
+    int degree = 0;
+    for (int i = 0; i < Dim; ++i) degree += a[i];
+
+    // Shifting an expansion by `d`: (y + d)^a = sum(C(a, g) * y^g * d^(a - g)).
+    for (size_t from = 0; from < termCount; ++from) {
+      const int *g = &powers[from * Dim];
+      int difference[Dim];
+      bool contained = true;
+      for (int i = 0; i < Dim; ++i) {
+        difference[i] = a[i] - g[i];
+        contained = contained && g[i] <= a[i];
+      }
+      if (!contained) continue;
+      Product product;
+      product.to = (int)to;
+      product.from = (int)from;
+      product.power = term(difference);
+      product.coeff = 1;
+      for (int i = 0; i < Dim; ++i) product.coeff *= binomial(a[i], g[i]);
+      shiftTable.push_back(product);
+    }
+
+    // Local coefficient `to` gets contributions of every multipole
+    // coefficient `from` through derivative D(to + from).
+    for (size_t from = 0; from < termCount; ++from) {
+      const int *k = &powers[from * Dim];
+      int sum[Dim], fromDegree = 0;
+      for (int i = 0; i < Dim; ++i) {
+        sum[i] = a[i] + k[i];
+        fromDegree += k[i];
+      }
+      if (degree + fromDegree > order) continue;
+      Product product;
+      product.to = (int)to;
+      product.from = (int)from;
+      product.power = term(sum);
+      product.coeff = fromDegree % 2 ? -1 : 1;
+      for (int i = 0; i < Dim; ++i) product.coeff *= binomial(sum[i], k[i]);
+      translationTable.push_back(product);
+    }
+
+    // d/dz_i of L(a) * z^a is a_i * L(a) * z^(a - e_i).
+    for (int i = 0; i < Dim; ++i) {
+      if (a[i] == 0) continue;
+      Product product;
+      product.to = i;
+      product.from = (int)to;
+      product.power = lowered[to * Dim + i];
+      product.coeff = a[i];
+      gradientTable[i].push_back(product);
+    }
+  }
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::computePowers(const double *d, double *result) const {
+  result[0] = 1;
+  for (size_t t = 1; t < termCount; ++t) {
+    const int *p = &powers[t * Dim];
+    int axis = 0;
+    while (p[axis] == 0) axis += 1;
+    result[t] = result[lowered[t * Dim + axis]] * d[axis];
+  }
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::computeDerivatives(const double *d, double *result) const {
+  double r2 = 0;
+  for (int axis = 0; axis < Dim; ++axis) r2 += d[axis] * d[axis];
+  double invR2 = 1 / r2;
+  result[0] = sqrt(invR2);
+  result[termCount] = 0;
+  for (size_t t = 1; t < termCount; ++t) {
+    const int *p = &powers[t * Dim];
+    const int *lower = &lowered[t * Dim];
+    const int *lowerTwice = &loweredTwice[t * Dim];
+    int n = 0;
+    double first = 0, second = 0;
+    for (int axis = 0; axis < Dim; ++axis) {
+      n += p[axis];
+      first += d[axis] * result[lower[axis]];
+      second += result[lowerTwice[axis]];
+    }
+    result[t] = -((2 * n - 1) * first + (n - 1) * second) * invR2 / n;
+  }
+}
+
+template <typename Real, int Dim>
+size_t Multipole<Real, Dim>::updateForces(QuadTree<Real, Dim> &_tree, BodyStore<Real, Dim> &_bodies) {
+  tree = &_tree;
+  bodies = &_bodies;
+  if (bodies->size() == 0) return 0;
+
+  // Forces come from the gradient of local expansions, so they need at
+  // least linear terms.
+  int expansionOrder = std::max(1, std::min(maxOrder, settings->multipoleOrder));
+  if (expansionOrder != order) prepare(expansionOrder);
+
+  size_t nodeCount = tree->getNodes().size();
+  size_t bodyCount = bodies->size();
+  multipoles.resize(nodeCount * termCount);
+  locals.assign(nodeCount * termCount, 0);
+  radius.resize(nodeCount);
+  first.resize(nodeCount);
+  count.resize(nodeCount);
+  kind.assign(nodeCount, Skipped);
+  for (int axis = 0; axis < Dim; ++axis) gradient[axis].assign(bodyCount, 0);
+
+  classifyCells();
+  upwardPass();
+
+  collectTargets();
+  size_t interactions = 0;
+  #pragma omp parallel for schedule(dynamic, 1) reduction(+:interactions)
+  for (size_t i = 0; i < targets.size(); ++i) {
+    interactions += interact(targets[i], 0);
+  }
+
+  downwardPass();
+  return interactions;
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::classifyCells() {
+  const std::vector<QuadTreeNode<Real, Dim>> &nodes = tree->getNodes();
+  const std::vector<size_t> &levelStart = tree->getLevelStart();
+  size_t levels = levelStart.size() - 1;
+
+  // Bottom up: range of bodies in every subtree...
+  for (size_t depth = levels; depth-- > 0;) {
+    #pragma omp parallel for
+    for (size_t i = levelStart[depth]; i < levelStart[depth + 1]; ++i) {
+      const QuadTreeNode<Real, Dim> &node = nodes[i];
+      if (node.bodyCount > 0) {
+        first[i] = node.firstBody;
+        count[i] = node.bodyCount;
+        continue;
+      }
+      uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+      first[i] = first[node.firstChild];
+      count[i] = 0;
+      for (uint32_t child = node.firstChild; child < childEnd; ++child) {
+        count[i] += count[child];
+      }
+    }
+  }
+
+  // ...and top down: which cells are leaves of the expansion tree.
+  kind[0] = count[0] <= leafSize || nodes[0].bodyCount > 0 ? Leaf : Internal;
+  for (size_t depth = 0; depth < levels; ++depth) {
+    #pragma omp parallel for
+    for (size_t i = levelStart[depth]; i < levelStart[depth + 1]; ++i) {
+      if (kind[i] != Internal) continue;
+      const QuadTreeNode<Real, Dim> &node = nodes[i];
+      uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+      for (uint32_t child = node.firstChild; child < childEnd; ++child) {
+        kind[child] = count[child] <= leafSize || nodes[child].bodyCount > 0 ? Leaf : Internal;
+      }
+    }
+  }
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::upwardPass() {
+  const std::vector<QuadTreeNode<Real, Dim>> &nodes = tree->getNodes();
+  const std::vector<size_t> &levelStart = tree->getLevelStart();
+  const std::vector<Real> &mass = tree->getSortedMass();
+
+  for (size_t depth = levelStart.size() - 1; depth-- > 0;) {
+    #pragma omp parallel for
+    for (size_t i = levelStart[depth]; i < levelStart[depth + 1]; ++i) {
+      if (kind[i] == Skipped) continue;
+      const QuadTreeNode<Real, Dim> &node = nodes[i];
+      double *multipole = &multipoles[i * termCount];
+      double power[maxTerms];
+      double nodeRadius = 0;
+      std::fill(multipole, multipole + termCount, 0.0);
+
+      if (kind[i] == Leaf) {
+        for (int j = first[i]; j < first[i] + count[i]; ++j) {
+          double d[Dim], r2 = 0;
+          for (int axis = 0; axis < Dim; ++axis) {
+            d[axis] = tree->getSortedPos(axis)[j] - node.massCenter[axis];
+            r2 += d[axis] * d[axis];
+          }
+          computePowers(d, power);
+          for (size_t t = 0; t < termCount; ++t) {
+            multipole[t] += mass[j] * power[t];
+          }
+          nodeRadius = std::max(nodeRadius, sqrt(r2));
+        }
+      } else {
+        uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < childEnd; ++child) {
+          const QuadTreeNode<Real, Dim> &childNode = nodes[child];
+          const double *childMultipole = &multipoles[child * termCount];
+          double d[Dim], r2 = 0;
+          for (int axis = 0; axis < Dim; ++axis) {
+            d[axis] = childNode.massCenter[axis] - node.massCenter[axis];
+            r2 += d[axis] * d[axis];
+          }
+          computePowers(d, power);
+          for (size_t k = 0; k < shiftTable.size(); ++k) {
+            const Product &product = shiftTable[k];
+            multipole[product.to] += product.coeff * childMultipole[product.from] * power[product.power];
+          }
+          nodeRadius = std::max(nodeRadius, sqrt(r2) + radius[child]);
+        }
+      }
+      radius[i] = nodeRadius;
+    }
+  }
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::collectTargets() {
+  // Every body must belong to exactly one target cell, and each target is
+  // processed by one thread: take all cells of the first level that is
+  // wide enough, plus leaves above it.
+  const std::vector<size_t> &levelStart = tree->getLevelStart();
+  size_t levels = levelStart.size() - 1;
+  size_t depth = 0;
+  while (depth + 1 < levels && levelStart[depth + 1] - levelStart[depth] < 256) {
+    depth += 1;
+  }
+
+  targets.clear();
+  for (size_t i = 0; i < levelStart[depth + 1]; ++i) {
+    if (kind[i] == Leaf || (kind[i] == Internal && i >= levelStart[depth])) {
+      targets.push_back((uint32_t)i);
+    }
+  }
+}
+
+template <typename Real, int Dim>
+size_t Multipole<Real, Dim>::interact(uint32_t target, uint32_t source) {
+  const std::vector<QuadTreeNode<Real, Dim>> &nodes = tree->getNodes();
+  const QuadTreeNode<Real, Dim> &targetNode = nodes[target];
+  const QuadTreeNode<Real, Dim> &sourceNode = nodes[source];
+  bool targetIsLeaf = kind[target] == Leaf;
+  bool sourceIsLeaf = kind[source] == Leaf;
+  uint32_t targetEnd = targetNode.firstChild + __builtin_popcount(targetNode.childMask);
+  uint32_t sourceEnd = sourceNode.firstChild + __builtin_popcount(sourceNode.childMask);
+
+  // A translated expansion counts as one interaction for every body of
+  // the target, a direct one as one per pair of bodies.
+  size_t interactions = 0;
+  if (target == source) {
+    if (targetIsLeaf) {
+      interactDirectly(target, source);
+      return (size_t)count[target] * count[source];
+    }
+    for (uint32_t a = targetNode.firstChild; a < targetEnd; ++a) {
+      for (uint32_t b = targetNode.firstChild; b < targetEnd; ++b) {
+        interactions += interact(a, b);
+      }
+    }
+    return interactions;
+  }
+
+  double r2 = 0;
+  for (int axis = 0; axis < Dim; ++axis) {
+    double d = targetNode.massCenter[axis] - sourceNode.massCenter[axis];
+    r2 += d * d;
+  }
+  double r = sqrt(r2);
+
+  if (radius[target] + radius[source] < settings->multipoleTheta * r) {
+    translate(target, source);
+    interactions = count[target];
+  } else if (targetIsLeaf && sourceIsLeaf) {
+    interactDirectly(target, source);
+    interactions = (size_t)count[target] * count[source];
+  } else if (sourceIsLeaf || (!targetIsLeaf && radius[target] >= radius[source])) {
+    for (uint32_t a = targetNode.firstChild; a < targetEnd; ++a) {
+      interactions += interact(a, source);
+    }
+  } else {
+    for (uint32_t b = sourceNode.firstChild; b < sourceEnd; ++b) {
+      interactions += interact(target, b);
+    }
+  }
+  return interactions;
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::translate(uint32_t target, uint32_t source) {
+  const std::vector<QuadTreeNode<Real, Dim>> &nodes = tree->getNodes();
+  const Real *to = nodes[target].massCenter;
+  const Real *from = nodes[source].massCenter;
+  double d[Dim], derivatives[maxTerms];
+  for (int axis = 0; axis < Dim; ++axis) d[axis] = to[axis] - from[axis];
+  computeDerivatives(d, derivatives);
+
+  double *local = &locals[target * termCount];
+  const double *multipole = &multipoles[source * termCount];
+  for (size_t k = 0; k < translationTable.size(); ++k) {
+    const Product &product = translationTable[k];
+    local[product.to] += product.coeff * multipole[product.from] * derivatives[product.power];
+  }
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::interactDirectly(uint32_t target, uint32_t source) {
+  const Real *sourcePos[Dim];
+  for (int axis = 0; axis < Dim; ++axis) sourcePos[axis] = &tree->getSortedPos(axis)[first[source]];
+  const Real *sourceMass = &tree->getSortedMass()[first[source]];
+
+  // When target is the source itself, every body meets itself at zero
+  // distance, which the kernel skips.
+  const std::vector<int> &order = tree->getOrder();
+  size_t targetCount = tree->getTargetCount();
+  for (int i = first[target]; i < first[target] + count[target]; ++i) {
+    if ((size_t)order[i] >= targetCount) continue;
+    Real point[Dim];
+    double total[Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      point[axis] = tree->getSortedPos(axis)[i];
+      total[axis] = gradient[axis][i];
+    }
+    kernels->repulsion(sourcePos, sourceMass, count[source], point, total);
+    for (int axis = 0; axis < Dim; ++axis) gradient[axis][i] = total[axis];
+  }
+}
+
+template <typename Real, int Dim>
+void Multipole<Real, Dim>::downwardPass() {
+  const std::vector<QuadTreeNode<Real, Dim>> &nodes = tree->getNodes();
+  const std::vector<size_t> &levelStart = tree->getLevelStart();
+  const std::vector<int> &order = tree->getOrder();
+  const std::vector<Real> &mass = tree->getSortedMass();
+  size_t targetCount = tree->getTargetCount();
+  double gravity = settings->gravity;
+
+  for (size_t depth = 0; depth + 1 < levelStart.size(); ++depth) {
+    #pragma omp parallel for
+    for (size_t i = levelStart[depth]; i < levelStart[depth + 1]; ++i) {
+      if (kind[i] == Skipped) continue;
+      const QuadTreeNode<Real, Dim> &node = nodes[i];
+      const double *local = &locals[i * termCount];
+      double power[maxTerms];
+
+      if (kind[i] == Internal) {
+        uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < childEnd; ++child) {
+          const QuadTreeNode<Real, Dim> &childNode = nodes[child];
+          double *childLocal = &locals[child * termCount];
+          double d[Dim];
+          for (int axis = 0; axis < Dim; ++axis) d[axis] = childNode.massCenter[axis] - node.massCenter[axis];
+          computePowers(d, power);
+          for (size_t k = 0; k < shiftTable.size(); ++k) {
+            const Product &product = shiftTable[k];
+            childLocal[product.from] += product.coeff * local[product.to] * power[product.power];
+          }
+        }
+        continue;
+      }
+
+      for (int j = first[i]; j < first[i] + count[i]; ++j) {
+        int body = order[j];
+        if ((size_t)body >= targetCount) continue;
+        double d[Dim];
+        for (int axis = 0; axis < Dim; ++axis) d[axis] = tree->getSortedPos(axis)[j] - node.massCenter[axis];
+        computePowers(d, power);
+
+        double coeff = gravity * mass[j];
+        for (int axis = 0; axis < Dim; ++axis) {
+          double total = gradient[axis][j];
+          const std::vector<Product> &table = gradientTable[axis];
+          for (size_t k = 0; k < table.size(); ++k) {
+            total += table[k].coeff * local[table[k].from] * power[table[k].power];
+          }
+          bodies->force[axis][body] = coeff * total;
+        }
+      }
+    }
+  }
+}
+
+template class Multipole<float, 2>;
+template class Multipole<float, 3>;
+template class Multipole<double, 2>;
+template class Multipole<double, 3>;
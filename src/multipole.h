@@ -0,0 +1,81 @@
+//
+//  multipole.h
+//  layout++
+//
+
+#ifndef __layout____multipole__
+#define __layout____multipole__
+
+#include <vector>
+#include "repulsion.h"
+#include "kernels.h"
+
+// Fast multipole method over the same tree Barnes-Hut uses. Each cell
+// gets a Cartesian multipole expansion of its bodies (upward pass); pairs
+// of well separated cells interact through expansions, which are
+// accumulated into local expansions (dual tree walk); local expansions are
+// pushed down to the bodies (downward pass). Nearby leaves interact
+// directly.
+//
+// Potential of body j at point x is m_j / |x - x_j|, and the force is
+// gravity * m_i * grad(potential), which is exactly what Barnes-Hut sums.
+// Expansions are always kept in double, whatever `Real` bodies use. The
+// same potential is used in 2D, so forces match Barnes-Hut there too.
+template <typename Real, int Dim>
+class Multipole : public RepulsionEngine<Real, Dim> {
+  const LayoutSettings *settings;
+  const ForceKernels<Real, Dim> *kernels;
+  const QuadTree<Real, Dim> *tree;
+  BodyStore<Real, Dim> *bodies;
+
+  // Expansion coefficients are stored per multi-index of `Dim` powers
+  // (a, b, c in 3D), with a + b + c <= order, sorted by total degree.
+  int order;
+  size_t termCount;
+  std::vector<int> powers;    // `Dim` powers of every term
+  std::vector<int> termIndex; // powers -> term
+  // For every term and axis, the term with that power lowered by one and
+  // by two. Missing terms point to an extra zero slot after the last term,
+  // so the recurrences need no branches.
+  std::vector<int> lowered, loweredTwice;
+  // Precomputed sums of the expansion operators. Each entry is
+  // `to += coeff * from * table[power]`.
+  struct Product {
+    int to;
+    int from;
+    int power;
+    double coeff;
+  };
+  std::vector<Product> shiftTable;       // multipole to multipole, local to local
+  std::vector<Product> translationTable; // multipole to local
+  std::vector<Product> gradientTable[Dim]; // local expansion to force
+
+  // The engine uses its own, coarser leaves: a subtree with few bodies is
+  // cheaper to handle directly than through expansions. Bodies of a
+  // subtree are contiguous in the sorted order, so such a cell is just a
+  // range [first, first + count).
+  enum CellKind { Skipped = 0, Leaf = 1, Internal = 2 };
+  std::vector<int> first, count;
+  std::vector<unsigned char> kind;
+  std::vector<double> multipoles, locals, radius;
+  std::vector<double> gradient[Dim];
+  std::vector<uint32_t> targets;
+
+  void prepare(int expansionOrder);
+  int term(const int *power) const;
+  void computePowers(const double *d, double *result) const;
+  void computeDerivatives(const double *d, double *result) const;
+
+  void classifyCells();
+  void upwardPass();
+  size_t interact(uint32_t target, uint32_t source);
+  void translate(uint32_t target, uint32_t source);
+  void interactDirectly(uint32_t target, uint32_t source);
+  void downwardPass();
+  void collectTargets();
+public:
+  Multipole(const LayoutSettings &_settings);
+  size_t updateForces(QuadTree<Real, Dim> &tree, BodyStore<Real, Dim> &bodies);
+};
+
+#endif /* defined(__layout____multipole__) */
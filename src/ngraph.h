@@ -0,0 +1,101 @@
+/*
+ *  ngraph.h
+ *  layout++
+ *
+ *  C interface of the layout, built into libngraph.so by ./compile-lib.
+ *  Only functions and types of this file are exported, and they only
+ *  change in ways that keep existing callers working: new functions and
+ *  settings may be added, nothing is removed or changes meaning. See
+ *  NGRAPH_API_VERSION.
+ *
+ *  Functions that can fail return a negative number (or NULL), and
+ *  ngraph_last_error() tells why. Errors are kept per thread.
+ */
+
+#ifndef __layout____ngraph__
+#define __layout____ngraph__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define NGRAPH_API __declspec(dllexport)
+#else
+#define NGRAPH_API __attribute__((visibility("default")))
+#endif
+
+/* Grows by one with every change of this file. */
+#define NGRAPH_API_VERSION 2
+
+/* Precision of the simulation state, see Layout. */
+#define NGRAPH_DOUBLE 0
+#define NGRAPH_FLOAT 1
+
+typedef struct ngraph_layout ngraph_layout;
+
+/* Live positions of all bodies: coordinate `axis` of body `i` is at
+ * (const char *)axes[axis] + i * stride, a double or a float as
+ * `precision` says. Axes past `dimensions` are NULL. */
+typedef struct {
+  const void *axes[3];
+  size_t count;
+  size_t stride;
+  int dimensions;
+  int precision;
+} ngraph_positions_view;
+
+NGRAPH_API int ngraph_api_version(void);
+/* The last error of this thread, or NULL. */
+NGRAPH_API const char *ngraph_last_error(void);
+
+/* `dimensions` is 2 or 3, `precision` NGRAPH_DOUBLE or NGRAPH_FLOAT.
+ * Returns NULL if they are not supported. */
+NGRAPH_API ngraph_layout *ngraph_create(int dimensions, int precision);
+NGRAPH_API void ngraph_destroy(ngraph_layout *layout);
+
+/* Builds the graph from `size` links in the links.bin format. Links are
+ * only read during the call; the caller keeps them. */
+NGRAPH_API int ngraph_init(ngraph_layout *layout, const int32_t *links, long size);
+/* Same, starting from `count` coordinates: `dimensions` per body. */
+NGRAPH_API int ngraph_init_positions(ngraph_layout *layout, const int32_t *links, long size,
+                                     const int32_t *positions, size_t count);
+
+/* Saves the whole state of the layout, see Layout::saveCheckpoint(). */
+NGRAPH_API int ngraph_save_checkpoint(ngraph_layout *layout, const char *fileName);
+/* Builds the graph from links and continues from a checkpoint of it, see
+ * Layout::resume(). */
+NGRAPH_API int ngraph_resume(ngraph_layout *layout, const int32_t *links, long size, const char *fileName);
+
+/* Runs up to `steps` steps. Returns the number of steps run: fewer than
+ * `steps` when the layout became stable. */
+NGRAPH_API long ngraph_step(ngraph_layout *layout, long steps);
+NGRAPH_API size_t ngraph_body_count(const ngraph_layout *layout);
+
+/* Points `view` at the positions the layout moves, with no copy. The view
+ * follows every step, and stays valid until the next ngraph_init*() or
+ * ngraph_resume(). */
+NGRAPH_API int ngraph_positions(const ngraph_layout *layout, ngraph_positions_view *view);
+/* Copies positions rounded to integers, `dimensions` per body, into
+ * `positions` of `count` values. */
+NGRAPH_API int ngraph_copy_positions(const ngraph_layout *layout, int32_t *positions, size_t count);
+
+/* Masses of the bodies, one per body, as weights.bin holds them. */
+NGRAPH_API int ngraph_set_weights(ngraph_layout *layout, const int32_t *weights, size_t count);
+NGRAPH_API int ngraph_get_weights(const ngraph_layout *layout, double *weights, size_t count);
+
+/* Settings by name of the LayoutSettings field, e.g. "theta" or
+ * "springLength". Flags are 0 or 1, enums are numbers in order of their
+ * values (repulsion: 0 BarnesHut, 1 Multipole; integrator: 0 Velocity,
+ * 1 Adaptive). Settings are read on every step. */
+NGRAPH_API int ngraph_set_setting(ngraph_layout *layout, const char *name, double value);
+NGRAPH_API int ngraph_get_setting(const ngraph_layout *layout, const char *name, double *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined(__layout____ngraph__) */
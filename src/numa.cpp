@@ -0,0 +1,58 @@
+//
+//  numa.cpp
+//  layout++
+//
+
+#include "numa.h"
+#include <cstdint>
+#include <omp.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+bool pinThreads() {
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+  vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+  }
+  if (cpus.empty()) return false;
+
+  bool pinned = true;
+  #pragma omp parallel reduction(&&:pinned)
+  {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &one);
+    pinned = pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0;
+  }
+  return pinned;
+#else
+  return false;
+#endif
+}
+
+bool interleaveMemory(const void *data, size_t bytes) {
+#if defined(__linux__) && defined(SYS_mbind)
+  if (bytes == 0) return true;
+  // Values of MPOL_INTERLEAVE and MPOL_MF_MOVE from <numaif.h>; the system
+  // call is used directly, so there is no dependency on libnuma. Nodes in
+  // the mask that do not exist or are not allowed are ignored by the kernel.
+  const int interleave = 3;
+  const unsigned move = 1 << 1;
+  unsigned long nodes = ~0UL;
+
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)data & ~(page - 1);
+  uintptr_t end = ((uintptr_t)data + bytes + page - 1) & ~(page - 1);
+  return syscall(SYS_mbind, begin, end - begin, interleave, &nodes, sizeof(nodes) * 8, move) == 0;
+#else
+  return false;
+#endif
+}
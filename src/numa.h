@@ -0,0 +1,65 @@
+//
+//  numa.h
+//  layout++
+//
+
+#ifndef __layout____numa__
+#define __layout____numa__
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <utility>
+
+using namespace std;
+
+// On a machine with several NUMA nodes (sockets), a page of memory lives on
+// the node of the thread that first writes it. Bodies are split between
+// threads by static partitioning of the body loops, so a page of body data
+// is read fastest by the thread that initialized it with the same
+// partitioning, on the same socket.
+
+// Allocator that leaves new elements uninitialized, so that
+// vector::resize() does not touch memory serially. The owner writes them
+// in parallel instead (see BodyStore::resize()).
+template <typename T>
+struct FirstTouchAllocator : std::allocator<T> {
+  template <typename U> struct rebind { typedef FirstTouchAllocator<U> other; };
+
+  FirstTouchAllocator() {}
+  template <typename U> FirstTouchAllocator(const FirstTouchAllocator<U> &) {}
+
+  template <typename U> void construct(U *p) { ::new ((void *)p) U; }
+  template <typename U, typename... Args> void construct(U *p, Args&&... args) {
+    ::new ((void *)p) U(std::forward<Args>(args)...);
+  }
+};
+
+// Pins every OpenMP thread to one CPU, in order of the CPUs the process may
+// run on, so that threads keep using memory of the socket they first
+// touched it from. Returns false if threads could not be pinned.
+bool pinThreads();
+
+// Asks the kernel to spread pages of the range over all NUMA nodes, moving
+// pages that exist already. Meant for data every thread reads, like the
+// top of the tree. Returns false where not supported.
+bool interleaveMemory(const void *data, size_t bytes);
+
+// Interleaves an array once, and again only after it moves.
+class InterleavedArray {
+  const void *data;
+  size_t bytes;
+public:
+  InterleavedArray() : data(NULL), bytes(0) {}
+
+  template <typename T, typename Alloc>
+  void update(const vector<T, Alloc> &array) {
+    size_t arrayBytes = array.capacity() * sizeof(T);
+    if (array.data() == data && arrayBytes == bytes) return;
+    data = array.data();
+    bytes = arrayBytes;
+    interleaveMemory(data, bytes);
+  }
+};
+
+#endif /* defined(__layout____numa__) */
@@ -10,9 +10,25 @@
 #define layout___primitives_h
 #include <cmath>        // std::abs
 #include <vector>
+#include <cstdint>
+#include "numa.h"
 
 using namespace std;
 
+enum class RepulsionMethod {
+  BarnesHut,
+  Multipole
+};
+
+enum class Integrator {
+  // Velocity with drag, at most one unit of length per unit of time.
+  Velocity,
+  // Bodies move along their force. A body whose force keeps turning around
+  // (swing) takes shorter steps, and the step of all bodies grows while
+  // forces mostly keep their direction (traction), as in ForceAtlas2.
+  Adaptive
+};
+
 struct LayoutSettings {
   double stableThreshold = 0.009;
   double gravity = -1.2;
@@ -21,6 +37,51 @@ struct LayoutSettings {
   double springCoeff = 0.0008;
   double springLength = 30;
   double timeStep = 20;
+  // Maximum number of bodies in a leaf of the tree. Bigger buckets give a
+  // shallower tree, and interactions with a bucket are computed directly.
+  int leafCapacity = 8;
+  // When set, the tree is walked once per leaf instead of once per body, and
+  // the resulting interaction list is shared by all bodies of the leaf.
+  bool groupTraversal = true;
+  // Which engine computes repulsion between bodies. Both use the same tree.
+  RepulsionMethod repulsion = RepulsionMethod::BarnesHut;
+  // Fast multipole method: order of multipole/local expansions (higher is
+  // more accurate and slower) and the opening ratio: two cells interact
+  // through expansions when (r1 + r2) / distance < multipoleTheta.
+  int multipoleOrder = 4;
+  double multipoleTheta = 0.7;
+  // When set, the tree keeps its root cell from step to step while all
+  // bodies stay in it (the root gets a small margin for this). Bodies that
+  // are still in the cell of their leaf keep their place in the Morton
+  // order; only those that left are sorted again and merged back, instead
+  // of sorting all bodies. The tree is rebuilt when more than
+  // refitThreshold of all bodies have left the cell of their leaf.
+  bool treeRefit = false;
+  double refitThreshold = 0.1;
+  // When set, init() without positions first lays out ever coarser versions
+  // of the graph (see Graph::coarsen), down to about coarsestSize bodies.
+  // The coarsest graph gets coarsestSteps steps. Going back up, every body
+  // starts next to the coarse body it was collapsed into, and each level
+  // gets refineSteps steps. The finest level is left to step().
+  bool multilevel = false;
+  size_t coarsestSize = 300;
+  int coarsestSteps = 500;
+  int refineSteps = 30;
+  // How positions follow forces. swingTolerance is the ratio of swing to
+  // traction over all bodies that Integrator::Adaptive aims for: higher is
+  // faster and less stable.
+  Integrator integrator = Integrator::Velocity;
+  double swingTolerance = 0.25;
+  // On machines with several NUMA nodes: pin OpenMP threads to CPUs (see
+  // pinThreads()) when bodies are created, and interleave the tree over
+  // all nodes, as every thread walks it. Bodies are placed next to the
+  // threads that use them in any case.
+  bool numa = false;
+  // ShardedLayout: steps between two repartitions of space between shards.
+  int rebalanceInterval = 20;
+  // Seed of every random number the layout draws. The same graph, settings
+  // and seed give bitwise identical layouts, whatever the number of threads.
+  uint64_t seed = 42;
 };
 
 struct Vector3 {
@@ -54,9 +115,9 @@ struct Body {
   Vector3 velocity;
   double mass = 1.0;
 
-  vector<int> springs; // these are outgoing connections.
   // This is just a number of incoming connections for this body,
-  // so we can count its mass appropriately.
+  // so we can count its mass appropriately. Outgoing connections live in
+  // the layout's Graph.
   int incomingCount = 0;
 
   Body() { }
@@ -71,6 +132,64 @@ struct Body {
     return pos.x != 0 || pos.y != 0 || pos.z != 0;
   }
 };
-class NotEnoughQuadSpaceException: public exception {};
+// Structure-of-arrays storage for the simulation state. The hot loops
+// (tree construction, force accumulation, integration) touch only the
+// arrays they need, so each body costs a few contiguous values of memory
+// bandwidth per pass instead of a whole `Body` record. `Real` is float or
+// double, `Dim` is 2 or 3; every vector quantity is stored as `Dim` arrays,
+// one per axis.
+template <typename Real, int Dim>
+struct BodyStore {
+  typedef vector<Real, FirstTouchAllocator<Real>> Array;
+  Array pos[Dim];
+  Array velocity[Dim];
+  Array force[Dim];
+  Array mass;
+  // Force of the previous step, kept by Integrator::Adaptive.
+  Array previousForce[Dim];
+
+  size_t size() const { return mass.size(); }
+
+  // New bodies are at zero, with mass 1. They are written by a static
+  // parallel loop, like the body loops of Layout, so that on NUMA machines
+  // every thread finds its bodies in memory of its own socket.
+  void resize(size_t count) {
+    size_t old = size();
+    for (int axis = 0; axis < Dim; ++axis) {
+      pos[axis].resize(count);
+      velocity[axis].resize(count);
+      force[axis].resize(count);
+      previousForce[axis].resize(count);
+    }
+    mass.resize(count);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = old; i < count; ++i) {
+      for (int axis = 0; axis < Dim; ++axis) {
+        pos[axis][i] = velocity[axis][i] = force[axis][i] = previousForce[axis][i] = 0;
+      }
+      mass[i] = 1;
+    }
+  }
+
+  // Only the first `Dim` coordinates of `p` are used.
+  void setPos(size_t i, const Vector3 &p) {
+    const double coordinates[3] = { p.x, p.y, p.z };
+    for (int axis = 0; axis < Dim; ++axis) pos[axis][i] = coordinates[axis];
+  }
+
+  Vector3 getPos(size_t i) const {
+    double coordinates[3] = { 0, 0, 0 };
+    for (int axis = 0; axis < Dim; ++axis) coordinates[axis] = pos[axis][i];
+    return Vector3(coordinates[0], coordinates[1], coordinates[2]);
+  }
+
+  bool positionInitialized(size_t i) const {
+    for (int axis = 0; axis < Dim; ++axis) {
+      if (pos[axis][i] != 0) return true;
+    }
+    return false;
+  }
+};
 
 #endif
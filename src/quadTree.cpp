@@ -10,248 +10,701 @@
 //
 
 #include "quadTree.h"
+#include "Random.h"
 #include <cmath>
+#include <algorithm>
+#include <utility>
 
-NotEnoughQuadSpaceException  _NotEnoughQuadSpaceException;
+namespace {
+  // Morton keys interleave `depth` bits of each coordinate into 64 bits,
+  // thus the tree is never deeper than `depth` levels.
+  template <int Dim> struct Morton;
 
-QuadTreeNode *QuadTree::createRootNode(std::vector<Body> &bodies) {
-  double x1 = INT32_MAX, x2 = INT32_MIN,
-  y1 = INT32_MAX, y2 = INT32_MIN,
-  z1 = INT32_MAX, z2 = INT32_MIN;
+  template <> struct Morton<3> {
+    static const int depth = 21;
+    // Spreads lower 21 bits of `v`, so that there are two zero bits between
+    // each pair of original bits.
+    static uint64_t spread(uint64_t v) {
+      v &= 0x1fffff;
+      v = (v | v << 32) & 0x1f00000000ffffULL;
+      v = (v | v << 16) & 0x1f0000ff0000ffULL;
+      v = (v | v << 8) & 0x100f00f00f00f00fULL;
+      v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+      v = (v | v << 2) & 0x1249249249249249ULL;
+      return v;
+    }
+  };
+
+  template <> struct Morton<2> {
+    static const int depth = 31;
+    // Spreads lower 31 bits of `v`, so that there is a zero bit between
+    // each pair of original bits.
+    static uint64_t spread(uint64_t v) {
+      v &= 0x7fffffff;
+      v = (v | v << 16) & 0x0000ffff0000ffffULL;
+      v = (v | v << 8) & 0x00ff00ff00ff00ffULL;
+      v = (v | v << 4) & 0x0f0f0f0f0f0f0f0fULL;
+      v = (v | v << 2) & 0x3333333333333333ULL;
+      v = (v | v << 1) & 0x5555555555555555ULL;
+      return v;
+    }
+  };
+
+  // Depth first walk pushes at most 2^Dim children per level.
+  template <int Dim>
+  struct Stack {
+    static const int size = (1 << Dim) * (Morton<Dim>::depth + 1);
+  };
+
+  const int radixBits = 8;
+  const size_t radixBuckets = 1 << radixBits;
+
+  template <int Dim>
+  inline uint64_t quantize(double value, double origin, double scale) {
+    const uint64_t cells = uint64_t(1) << Morton<Dim>::depth;
+    double cell = (value - origin) * scale;
+    if (cell < 0) return 0;
+    if (cell >= cells) return cells - 1;
+    return static_cast<uint64_t>(cell);
+  }
+
+  // Index of the quad at `depth` (root's children are at depth 1), see
+  // QuadTreeNode::childMask.
+  template <int Dim>
+  inline int quadIndex(uint64_t key, size_t depth) {
+    return (key >> (Dim * (Morton<Dim>::depth - depth))) & ((1 << Dim) - 1);
+  }
 
-  for (std::vector<Body>::iterator body = bodies.begin() ; body != bodies.end(); ++body) {
-    double x = body->pos.x;
-    double y = body->pos.y;
-    double z = body->pos.z;
-    if (x < x1) x1 = x;
-    if (x > x2) x2 = x;
-    if (y < y1) y1 = y;
-    if (y > y2) y2 = y;
-    if (z < z1) z1 = z;
-    if (z > z2) z2 = z;
+  // Returns position of the first key in [begin, end) that falls into `quad`
+  // or further at given depth. Keys in the range share all higher digits,
+  // so quad indices are sorted.
+  template <int Dim>
+  inline size_t quadStart(const uint64_t *keys, size_t begin, size_t end, size_t depth, int quad) {
+    while (begin < end) {
+      size_t middle = begin + (end - begin) / 2;
+      if (quadIndex<Dim>(keys[middle], depth) < quad) {
+        begin = middle + 1;
+      } else {
+        end = middle;
+      }
+    }
+    return begin;
   }
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::findBounds(double *low, double *high) {
+  for (int axis = 0; axis < Dim; ++axis) {
+    low[axis] = INT32_MAX;
+    high[axis] = INT32_MIN;
+  }
+
+  #pragma omp parallel for reduction(min:low[:Dim]) reduction(max:high[:Dim])
+  for (size_t i = 0; i < bodies->size(); ++i) {
+    for (int axis = 0; axis < Dim; ++axis) {
+      double v = bodies->pos[axis][i];
+      if (v < low[axis]) low[axis] = v;
+      if (v > high[axis]) high[axis] = v;
+    }
+  }
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::createRootNode(const double *bodiesLow, const double *high) {
+  double low[Dim];
+  for (int axis = 0; axis < Dim; ++axis) low[axis] = bodiesLow[axis];
 
   // squarify bounds:
-  double maxSide = std::max(x2 - x1, std::max(y2 - y1, z2 - z1));
+  double maxSide = 0;
+  for (int axis = 0; axis < Dim; ++axis) {
+    maxSide = std::max(maxSide, high[axis] - low[axis]);
+  }
 
   if (maxSide == 0) {
-    maxSide = bodies.size() * 500;
-    x1 -=  maxSide;
-    y1 -=  maxSide;
-    z1 -=  maxSide;
-    x2 += maxSide;
-    y2 += maxSide;
-    z2 += maxSide;
+    maxSide = bodies->size() * 500;
+    for (int axis = 0; axis < Dim; ++axis) low[axis] -= maxSide;
+    maxSide *= 2;
+  }
+  // A refitted tree keeps its root while bodies stay in it (see refit()),
+  // and layouts slowly spread out: leave them a little room.
+  if (layoutSettings->treeRefit) {
+    double margin = maxSide / 64;
+    for (int axis = 0; axis < Dim; ++axis) low[axis] -= margin;
+    maxSide += 2 * margin;
+  }
+
+  nodes.resize(1);
+  QuadTreeNode<Real, Dim> &root = nodes[0];
+  root.halfWidth = maxSide / 2;
+  for (int axis = 0; axis < Dim; ++axis) {
+    root.center[axis] = low[axis] + root.halfWidth;
+  }
+  root.firstChild = root.childMask = 0;
+  root.firstBody = 0;
+  root.bodyCount = (int)bodies->size();
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::insertBodies(BodyStore<Real, Dim> &_bodies, size_t step) {
+  insertBodies(_bodies, step, _bodies.size());
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::insertBodies(BodyStore<Real, Dim> &_bodies, size_t step, size_t targets) {
+  bool sameBodies = bodies == &_bodies && order.size() == _bodies.size() && targetCount == targets && !nodes.empty();
+  bodies = &_bodies;
+  targetCount = std::min(targets, _bodies.size());
+  double low[Dim], high[Dim];
+  findBounds(low, high);
+  bool refitted = false;
+  if (layoutSettings->treeRefit && sameBodies) {
+    // A failed refit costs a good part of a rebuild: while bodies keep
+    // leaving their cells (early steps of a layout), stop trying for a while.
+    if (refitSkips > 0) {
+      refitSkips -= 1;
+    } else if (refit(step, low, high)) {
+      refitted = true;
+      refitBackoff = 1;
+    } else {
+      refitSkips = refitBackoff;
+      refitBackoff = std::min(refitBackoff * 2, (size_t)16);
+    }
+  }
+  if (refitted) {
+    stats.refits += 1;
   } else {
-    x2 = x1 + maxSide;
-    y2 = y1 + maxSide;
-    z2 = z1 + maxSide;
+    rebuild(step, low, high);
+    stats.rebuilds += 1;
   }
+  updateMass();
+}
 
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::rebuild(size_t step, double *low, double *high) {
+  createRootNode(low, high);
+  sortBodies();
+  if (separateDuplicates(step)) {
+    findBounds(low, high);
+    createRootNode(low, high);
+    sortBodies();
+  }
+  splitLevels();
+}
 
-  QuadTreeNode *root = treeNodes.get();
-  root->left = x1;
-  root->right = x2;
-  root->top = y1;
-  root->bottom = y2;
-  root->back = z1;
-  root->front = z2;
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::splitLevels() {
+  levelStart.assign(1, 0);
+  levelStart.push_back(1);
+  for (size_t depth = 0; depth < (size_t)Morton<Dim>::depth; ++depth) {
+    if (!splitLevel(depth)) break;
+  }
+  updateInterleaved();
+}
 
-  return root;
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::updateInterleaved() {
+  // Every thread walks the tree from the root, so no part of it belongs
+  // to one socket.
+  if (layoutSettings->numa) {
+    interleavedNodes.update(nodes);
+    for (int axis = 0; axis < Dim; ++axis) interleavedPos[axis].update(sortedPos[axis]);
+    interleavedMass.update(sortedMass);
+  }
 }
 
-void QuadTree::insert(Body *body, QuadTreeNode *node) {
-  if (!node->body) {
-    // This is internal node. Update the total mass of the node and center-of-mass.
-    double x = body->pos.x;
-    double y = body->pos.y;
-    double z = body->pos.z;
-    node->mass += body->mass;
-    node->massVector.x += body->mass * x;
-    node->massVector.y += body->mass * y;
-    node->massVector.z += body->mass * z;
-    // Recursively insert the body in the appropriate quadrant.
-    // But first find the appropriate quadrant.
-    int quadIdx = 0; // Assume we are in the 0's quad.
-    double left = node->left,
-    right = (node->right + left) / 2,
-    top = node->top,
-    bottom = (node->bottom + top) / 2,
-    back = node->back,
-    front = (node->front + back) / 2;
-
-    if (x > right) { // somewhere in the eastern part.
-      quadIdx += 1;
-      left = right;
-      right = node->right;
-    }
-    if (y > bottom) { // and in south.
-      quadIdx += 2;
-      top = bottom;
-      bottom = node->bottom;
+template <typename Real, int Dim>
+bool QuadTree<Real, Dim>::refit(size_t step, double *low, double *high) {
+  // The root cell is kept, so keys of bodies that stayed in their leaf keep
+  // the leaf's prefix. Those bodies only need sorting within the leaf; the
+  // others are sorted on their own and merged back into the Morton order,
+  // which costs far less than sorting all keys again.
+  QuadTreeNode<Real, Dim> root = nodes[0];
+  double origin[Dim];
+  for (int axis = 0; axis < Dim; ++axis) origin[axis] = root.center[axis] - root.halfWidth;
+  double scale = (uint64_t(1) << Morton<Dim>::depth) / (2 * root.halfWidth);
+  size_t count = order.size();
+
+  // A body outside of the root needs a bigger one, and bodies in a fraction
+  // of it a smaller one, or the tree grows too deep.
+  double maxSide = 0;
+  for (int axis = 0; axis < Dim; ++axis) {
+    if (low[axis] < origin[axis] || high[axis] >= origin[axis] + 2 * root.halfWidth) return false;
+    maxSide = std::max(maxSide, high[axis] - low[axis]);
+  }
+  if (maxSide < root.halfWidth) return false;
+
+  // New keys of the bodies of every leaf. Leaves of depth `d` cover the
+  // keys that share their top `Dim * d` bits; bodies that stayed in their
+  // leaf go first, sorted by insertion (a few bodies, nearly in order
+  // already), and the ones that left after, marked by a negative id.
+  size_t moved = 0;
+  #pragma omp parallel for reduction(+:moved)
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const QuadTreeNode<Real, Dim> &leaf = nodes[i];
+    if (leaf.bodyCount == 0) continue;
+    size_t depth = std::upper_bound(levelStart.begin(), levelStart.end(), i) - levelStart.begin() - 1;
+    int shift = Dim * (Morton<Dim>::depth - (int)depth);
+    int stayed = leaf.firstBody;
+    for (int j = leaf.firstBody; j < leaf.firstBody + leaf.bodyCount; ++j) {
+      int body = order[j];
+      uint64_t key = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        key |= Morton<Dim>::spread(quantize<Dim>(bodies->pos[axis][body], origin[axis], scale)) << axis;
+      }
+      if ((key >> shift) != (keys[j] >> shift)) {
+        keysBuffer[j] = key;
+        orderBuffer[j] = -1 - body;
+        moved += 1;
+        continue;
+      }
+      int k = j;
+      for (; k > stayed; --k) {
+        keysBuffer[k] = keysBuffer[k - 1];
+        orderBuffer[k] = orderBuffer[k - 1];
+      }
+      for (; k > leaf.firstBody && keysBuffer[k - 1] > key; --k) {
+        keysBuffer[k] = keysBuffer[k - 1];
+        orderBuffer[k] = orderBuffer[k - 1];
+      }
+      keysBuffer[k] = key;
+      orderBuffer[k] = body;
+      stayed += 1;
     }
-    if (z > front) { // and in frontal part
-      quadIdx += 4;
-      back = front;
-      front = node->front;
+  }
+  if (moved > layoutSettings->refitThreshold * count) return false;
+
+  // Leaves are in Morton order, so bodies that stayed are now sorted.
+  std::vector<std::pair<uint64_t, int>> movers;
+  movers.reserve(moved);
+  size_t stayed = 0;
+  for (size_t j = 0; j < count; ++j) {
+    if (orderBuffer[j] < 0) {
+      movers.push_back(std::make_pair(keysBuffer[j], -1 - orderBuffer[j]));
+    } else {
+      keys[stayed] = keysBuffer[j];
+      order[stayed++] = orderBuffer[j];
     }
+  }
+  std::sort(movers.begin(), movers.end());
 
-    QuadTreeNode *child = node->quads[quadIdx];
-    if (!child) {
-      // The node is internal but this quadrant is not taken. Add subnode to it.
-      child = treeNodes.get();
-      child->left = left;
-      child->top = top;
-      child->right = right;
-      child->bottom = bottom;
-      child->back = back;
-      child->front = front;
-      child->body = body;
-      node->quads[quadIdx] = child;
+  // Merge from the back, in place. Of equal keys, bodies that stayed go
+  // first.
+  size_t next = count;
+  while (!movers.empty()) {
+    next -= 1;
+    if (stayed > 0 && keys[stayed - 1] > movers.back().first) {
+      stayed -= 1;
+      keys[next] = keys[stayed];
+      order[next] = order[stayed];
     } else {
-      // continue searching in this quadrant.
-      insert(body, child);
+      keys[next] = movers.back().first;
+      order[next] = movers.back().second;
+      movers.pop_back();
     }
-  } else {
-    // We are trying to add to the leaf node.
-    // We have to convert current leaf into internal node
-    // and continue adding two nodes.
-    Body *oldBody = node->body;
-    node->body = NULL; // internal nodes do not carry bodies
-    if (oldBody->pos.sameAs(body->pos)) {
-      int retriesCount = 3;
-      do {
-        double offset = random.nextDouble(),
-        dx = (node->right - node->left) * offset,
-        dy = (node->bottom - node->top) * offset,
-        dz = (node->front - node->back) * offset;
-
-        oldBody->pos.x = node->left + dx;
-        oldBody->pos.y = node->top + dy;
-        oldBody->pos.z = node->back + dz;
-        retriesCount -= 1;
-        // Make sure we don't bump it out of the box. If we do, next iteration should fix it
-      } while (retriesCount > 0 && oldBody->pos.sameAs(body->pos));
-
-      if (retriesCount == 0 && oldBody->pos.sameAs(body->pos)) {
-        // This is very bad, we ran out of precision.
-        // We cannot proceed under current root's constraints, so let's
-        // throw - this will cause parent to give bigger space for the root
-        // node, and hopefully we can fit on the subsequent iteration.
-        throw _NotEnoughQuadSpaceException;
+  }
+
+  gatherSorted();
+  if (separateDuplicates(step)) {
+    findBounds(low, high);
+    return false;
+  }
+
+  // Every leaf kept its bodies, so the split is the same as before.
+  if (moved == 0) {
+    updateInterleaved();
+    return true;
+  }
+  nodes.resize(1);
+  root.firstChild = root.childMask = 0;
+  root.firstBody = 0;
+  root.bodyCount = (int)count;
+  nodes[0] = root;
+  splitLevels();
+  return true;
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::sortBodies() {
+  size_t count = bodies->size();
+  keys.resize(count);
+  order.resize(count);
+  keysBuffer.resize(count);
+  orderBuffer.resize(count);
+
+  const QuadTreeNode<Real, Dim> &root = nodes[0];
+  double origin[Dim];
+  for (int axis = 0; axis < Dim; ++axis) {
+    origin[axis] = root.center[axis] - root.halfWidth;
+  }
+  double scale = (uint64_t(1) << Morton<Dim>::depth) / (2 * root.halfWidth);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t key = 0;
+    for (int axis = 0; axis < Dim; ++axis) {
+      key |= Morton<Dim>::spread(quantize<Dim>(bodies->pos[axis][i], origin[axis], scale)) << axis;
+    }
+    keys[i] = key;
+    order[i] = (int)i;
+  }
+
+  // Parallel LSD radix sort. Input is split into fixed blocks (rather than
+  // per thread) so that the result does not depend on number of threads.
+  size_t blocks = std::max((size_t)1, std::min((size_t)256, count / 4096));
+  std::vector<size_t> histogram(blocks * radixBuckets);
+  for (int shift = 0; shift < Dim * Morton<Dim>::depth; shift += radixBits) {
+    std::fill(histogram.begin(), histogram.end(), 0);
+
+    #pragma omp parallel for
+    for (size_t block = 0; block < blocks; ++block) {
+      size_t *counts = &histogram[block * radixBuckets];
+      for (size_t i = count * block / blocks; i < count * (block + 1) / blocks; ++i) {
+        counts[(keys[i] >> shift) & (radixBuckets - 1)] += 1;
+      }
+    }
+
+    size_t offset = 0;
+    bool allInOneBucket = false;
+    for (size_t digit = 0; digit < radixBuckets; ++digit) {
+      size_t digitTotal = 0;
+      for (size_t block = 0; block < blocks; ++block) {
+        size_t blockCount = histogram[block * radixBuckets + digit];
+        histogram[block * radixBuckets + digit] = offset;
+        offset += blockCount;
+        digitTotal += blockCount;
       }
+      if (digitTotal == count) allInOneBucket = true;
     }
-    // Next iteration should subdivide node further.
-    insert(oldBody, node);
-    insert(body, node);
+    // Nothing to reorder, all keys have the same digit.
+    if (allInOneBucket) continue;
+
+    #pragma omp parallel for
+    for (size_t block = 0; block < blocks; ++block) {
+      size_t *offsets = &histogram[block * radixBuckets];
+      for (size_t i = count * block / blocks; i < count * (block + 1) / blocks; ++i) {
+        size_t target = offsets[(keys[i] >> shift) & (radixBuckets - 1)]++;
+        keysBuffer[target] = keys[i];
+        orderBuffer[target] = order[i];
+      }
+    }
+    keys.swap(keysBuffer);
+    order.swap(orderBuffer);
   }
+
+  gatherSorted();
 }
 
-void QuadTree::insertBodies(std::vector<Body> &bodies) {
-  try {
-    treeNodes.reset();
-    root = createRootNode(bodies);
-    if (bodies.size() > 0) {
-      root->body = &bodies[0];
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::gatherSorted() {
+  size_t count = order.size();
+  for (int axis = 0; axis < Dim; ++axis) sortedPos[axis].resize(count);
+  sortedMass.resize(count);
+  #pragma omp parallel for
+  for (size_t i = 0; i < count; ++i) {
+    int body = order[i];
+    for (int axis = 0; axis < Dim; ++axis) {
+      sortedPos[axis][i] = bodies->pos[axis][body];
+    }
+    sortedMass[i] = bodies->mass[body];
+  }
+}
+
+template <typename Real, int Dim>
+bool QuadTree<Real, Dim>::separateDuplicates(size_t step) {
+  // Force kernels ignore pairs at zero distance, so bodies that share a
+  // position would never push each other apart. Equal positions have equal
+  // keys and end up next to each other after sorting: all but the first one
+  // are moved by a small offset, which depends only on the body and step.
+  // Sources are neither moved nor counted, so that where a target goes does
+  // not depend on them.
+  CounterRandom jitter(layoutSettings->seed, DuplicateStream);
+  bool moved = false;
+  #pragma omp parallel for reduction(||:moved)
+  for (size_t i = 1; i < order.size(); ++i) {
+    int body = order[i];
+    if ((size_t)body >= targetCount) continue;
+    bool duplicate = false;
+    for (size_t j = i; j-- > 0 && !duplicate;) {
+      bool same = true;
+      for (int axis = 0; axis < Dim; ++axis) {
+        same = same && sortedPos[axis][j] == sortedPos[axis][i];
+      }
+      if (!same) break;
+      duplicate = (size_t)order[j] < targetCount;
+    }
+    if (!duplicate) continue;
+
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies->pos[axis][body] += (jitter.nextDouble(body, step, axis) - 0.5) / 50;
     }
+    moved = true;
+  }
+  return moved;
+}
+
+template <typename Real, int Dim>
+bool QuadTree<Real, Dim>::splitLevel(size_t depth) {
+  const int quads = 1 << Dim;
+  size_t childDepth = depth + 1;
+  size_t levelBegin = levelStart[depth], levelEnd = levelStart[childDepth];
+  size_t levelSize = levelEnd - levelBegin;
+  childOffsets.assign(levelSize + 1, 0);
 
-    for (size_t i = 1; i < bodies.size(); ++i) {
-      insert(&(bodies[i]), root);
+  int leafCapacity = std::max(1, layoutSettings->leafCapacity);
+
+  // First let's count how many children each node will have...
+  #pragma omp parallel for
+  for (size_t i = 0; i < levelSize; ++i) {
+    const QuadTreeNode<Real, Dim> &node = nodes[levelBegin + i];
+    if (node.bodyCount <= leafCapacity) continue;
+    size_t begin = node.firstBody, end = begin + node.bodyCount;
+    size_t children = 0;
+    for (int quad = 0; quad < quads && begin < end; ++quad) {
+      size_t next = quadStart<Dim>(keys.data(), begin, end, childDepth, quad + 1);
+      if (next > begin) children += 1;
+      begin = next;
     }
-    return;
-  } catch(NotEnoughQuadSpaceException &e) {
-    // well we tried, but some bodies ended up on the same
-    // spot, cannot do anything, but hope that next iteration will fix it
-  }
-};
-
-void QuadTree::updateBodyForce(Body *sourceBody) {
-  std::vector<QuadTreeNode *> queue;
-  int queueLength = 1;
-  int shiftIndex = 0;
-  size_t pushIndex = 0;
-  double v, dx, dy, dz, r;
-  double fx = 0, fy = 0, fz = 0;
-  queue.push_back(root);
-  while (queueLength) {
-    QuadTreeNode *node = queue[shiftIndex];
-    Body *body = node->body;
-    queueLength -= 1;
-    shiftIndex += 1;
-    bool differentBody = (body != sourceBody);
-    if (body != NULL && differentBody) {
-      // If the current node is a leaf node (and it is not source body),
-      // calculate the force exerted by the current node on body, and add this
-      // amount to body's net force.
-      dx = body->pos.x - sourceBody->pos.x;
-      dy = body->pos.y - sourceBody->pos.y;
-      dz = body->pos.z - sourceBody->pos.z;
-      r = sqrt(dx * dx + dy * dy + dz * dz);
-
-      if (r == 0) {
-        // Poor man's protection against zero distance.
-        dx = (random.nextDouble() - 0.5) / 50;
-        dy = (random.nextDouble() - 0.5) / 50;
-        dz = (random.nextDouble() - 0.5) / 50;
-        r = sqrt(dx * dx + dy * dy + dz * dz);
+    childOffsets[i + 1] = children;
+  }
+
+  for (size_t i = 0; i < levelSize; ++i) {
+    childOffsets[i + 1] += childOffsets[i];
+  }
+
+  // ...so that the next level can be appended to the arena in parallel.
+  size_t total = childOffsets[levelSize];
+  if (total == 0) return false;
+  nodes.resize(levelEnd + total);
+  levelStart.push_back(levelEnd + total);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < levelSize; ++i) {
+    QuadTreeNode<Real, Dim> &node = nodes[levelBegin + i];
+    if (node.bodyCount <= leafCapacity) continue;
+    size_t begin = node.firstBody, end = begin + node.bodyCount;
+    size_t childIndex = levelEnd + childOffsets[i];
+    double childHalfWidth = node.halfWidth / 2;
+    node.firstChild = (uint32_t)childIndex;
+
+    for (int quad = 0; quad < quads && begin < end; ++quad) {
+      size_t next = quadStart<Dim>(keys.data(), begin, end, childDepth, quad + 1);
+      if (next == begin) continue;
+
+      QuadTreeNode<Real, Dim> &child = nodes[childIndex];
+      for (int axis = 0; axis < Dim; ++axis) {
+        child.center[axis] = node.center[axis] + ((quad >> axis) & 1 ? childHalfWidth : -childHalfWidth);
       }
+      child.halfWidth = childHalfWidth;
+      child.firstChild = child.childMask = 0;
+      child.firstBody = (int)begin;
+      child.bodyCount = (int)(next - begin);
+      node.childMask |= 1 << quad;
+      childIndex += 1;
+      begin = next;
+    }
+    // internal nodes do not carry bodies
+    node.bodyCount = 0;
+  }
 
-      // This is standard gravitation force calculation but we divide
-      // by r^3 to save two operations when normalizing force vector.
-
-      v = layoutSettings->gravity * body->mass * sourceBody->mass / (r * r * r);
-      fx += v * dx;
-      fy += v * dy;
-      fz += v * dz;
-    } else if (differentBody) {
-      // Otherwise, calculate the ratio s / r,  where s is the width of the region
-      // represented by the internal node, and r is the distance between the body
-      // and the node's center-of-mass
-
-      dx = node->massVector.x / node->mass - sourceBody->pos.x;
-      dy = node->massVector.y / node->mass - sourceBody->pos.y;
-      dz = node->massVector.z / node->mass - sourceBody->pos.z;
-
-      r = sqrt(dx * dx + dy * dy + dz * dz);
-
-      if (r == 0) {
-        // Sorry about code duplication. I don't want to create many functions
-        // right away. Just want to see performance first.
-        dx = (random.nextDouble() - 0.5) / 50;
-        dy = (random.nextDouble() - 0.5) / 50;
-        dz = (random.nextDouble() - 0.5) / 50;
-        r = sqrt(dx * dx + dy * dy + dz * dz);
+  return true;
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::updateMass() {
+  // Bottom up: when a level is processed, all its children are done.
+  for (size_t depth = levelStart.size() - 1; depth-- > 0;) {
+    #pragma omp parallel for
+    for (size_t i = levelStart[depth]; i < levelStart[depth + 1]; ++i) {
+      QuadTreeNode<Real, Dim> &node = nodes[i];
+      double mass = 0, moment[Dim] = {};
+      if (node.bodyCount > 0) {
+        for (int j = node.firstBody; j < node.firstBody + node.bodyCount; ++j) {
+          double bodyMass = sortedMass[j];
+          mass += bodyMass;
+          for (int axis = 0; axis < Dim; ++axis) moment[axis] += bodyMass * sortedPos[axis][j];
+        }
+      } else {
+        uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+        for (uint32_t c = node.firstChild; c < childEnd; ++c) {
+          const QuadTreeNode<Real, Dim> &child = nodes[c];
+          double childMass = child.mass;
+          mass += childMass;
+          for (int axis = 0; axis < Dim; ++axis) moment[axis] += childMass * child.massCenter[axis];
+        }
       }
-      // If s / r < θ, treat this internal node as a single body, and calculate the
+      node.mass = mass;
+      for (int axis = 0; axis < Dim; ++axis) {
+        node.massCenter[axis] = mass > 0 ? moment[axis] / mass : node.center[axis];
+      }
+    }
+  }
+}
+
+template <typename Real, int Dim>
+size_t QuadTree<Real, Dim>::updateBodyForce(size_t sourceBody) {
+  Real source[Dim];
+  for (int axis = 0; axis < Dim; ++axis) source[axis] = bodies->pos[axis][sourceBody];
+  const Real sourceMass = bodies->mass[sourceBody];
+  uint32_t stack[Stack<Dim>::size];
+  int stackSize = 0;
+  double force[Dim] = {};
+  size_t interactions = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    const QuadTreeNode<Real, Dim> *node = &nodes[stack[--stackSize]];
+    if (node->bodyCount != 1) {
+      // This is internal node or a bucket of bodies. Calculate the ratio s / r,
+      // where s is the width of the region represented by the node, and r is
+      // the distance between the body and the node's center-of-mass
+
+      double d[Dim], r2 = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        d[axis] = node->massCenter[axis] - source[axis];
+        r2 += d[axis] * d[axis];
+      }
+      double r = sqrt(r2);
+
+      // If s / r < θ, treat this node as a single body, and calculate the
       // force it exerts on sourceBody, and add this amount to sourceBody's net force.
-      if ((node->right - node->left) / r < layoutSettings->theta) {
+      // Zero distance never passes the test, such node is opened instead.
+      if (2 * node->halfWidth / r < layoutSettings->theta) {
         // in the if statement above we consider node's width only
         // because the region was squarified during tree creation.
         // Thus there is no difference between using width or height.
-        v = layoutSettings->gravity * node->mass * sourceBody->mass / (r * r * r);
-        fx += v * dx;
-        fy += v * dy;
-        fz += v * dz;
-      } else {
+        double v = node->mass / (r * r * r);
+        for (int axis = 0; axis < Dim; ++axis) force[axis] += v * d[axis];
+        interactions += 1;
+        continue;
+      }
+
+      if (node->bodyCount == 0) {
         // Otherwise, run the procedure recursively on each of the current node's children.
-        for (int i = 0; i < 8; ++i) {
-          if (node->quads[i]) {
-            if (queue.size() < pushIndex) {
-              queue[pushIndex] = node->quads[i];
-            } else {
-              queue.push_back(node->quads[i]);
-            }
-            queueLength += 1;
-            pushIndex += 1;
-          }
+        uint32_t childEnd = node->firstChild + __builtin_popcount(node->childMask);
+        for (uint32_t child = node->firstChild; child < childEnd; ++child) {
+          stack[stackSize++] = child;
+        }
+        continue;
+      }
+    }
+
+    // This is a leaf that is too close to be approximated. Calculate the
+    // force exerted by each of its bodies on source body. The source body
+    // itself is at zero distance and contributes nothing.
+    const Real *position[Dim];
+    for (int axis = 0; axis < Dim; ++axis) position[axis] = &sortedPos[axis][node->firstBody];
+    kernels->repulsion(position, &sortedMass[node->firstBody], node->bodyCount, source, force);
+    interactions += node->bodyCount;
+  }
+
+  double coeff = layoutSettings->gravity * sourceMass;
+  for (int axis = 0; axis < Dim; ++axis) {
+    bodies->force[axis][sourceBody] += coeff * force[axis];
+  }
+  return interactions;
+}
+
+
+template <typename Real, int Dim>
+size_t QuadTree<Real, Dim>::updateGroupForces() {
+  size_t interactions = 0;
+  #pragma omp parallel reduction(+:interactions)
+  {
+    InteractionList<Real, Dim> list;
+
+    #pragma omp for schedule(dynamic, 64)
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      const QuadTreeNode<Real, Dim> &leaf = nodes[i];
+      if (leaf.bodyCount == 0) continue;
+      int targets = 0;
+      for (int j = leaf.firstBody; j < leaf.firstBody + leaf.bodyCount; ++j) {
+        targets += (size_t)order[j] < targetCount;
+      }
+      if (targets == 0) continue;
+
+      collectInteractions(leaf, list);
+      updateGroupForces(leaf, list);
+      interactions += list.mass.size() * targets;
+    }
+  }
+  return interactions;
+}
+
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::collectInteractions(const QuadTreeNode<Real, Dim> &leaf, InteractionList<Real, Dim> &list) {
+  list.clear();
+
+  // Bounding box of the group. Every body of the group is at least as far
+  // from a node as this box, so if the box passes the s / r < θ test the
+  // node can be approximated for every body of the group.
+  Real low[Dim], high[Dim];
+  for (int axis = 0; axis < Dim; ++axis) {
+    low[axis] = high[axis] = sortedPos[axis][leaf.firstBody];
+    for (int j = leaf.firstBody + 1; j < leaf.firstBody + leaf.bodyCount; ++j) {
+      low[axis] = std::min(low[axis], sortedPos[axis][j]);
+      high[axis] = std::max(high[axis], sortedPos[axis][j]);
+    }
+  }
+
+  uint32_t stack[Stack<Dim>::size];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    const QuadTreeNode<Real, Dim> &node = nodes[stack[--stackSize]];
+    if (node.bodyCount != 1) {
+      Real r2 = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        Real d = std::max(Real(0), std::max(low[axis] - node.massCenter[axis], node.massCenter[axis] - high[axis]));
+        r2 += d * d;
+      }
+      Real r = std::sqrt(r2);
+
+      if (r > 0 && 2 * node.halfWidth / r < layoutSettings->theta) {
+        list.add(node.massCenter, node.mass);
+        continue;
+      }
+
+      if (node.bodyCount == 0) {
+        uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < childEnd; ++child) {
+          stack[stackSize++] = child;
         }
+        continue;
       }
     }
 
+    // The leaf is too close to the group, its bodies interact directly.
+    for (int j = node.firstBody; j < node.firstBody + node.bodyCount; ++j) {
+      Real point[Dim];
+      for (int axis = 0; axis < Dim; ++axis) point[axis] = sortedPos[axis][j];
+      list.add(point, sortedMass[j]);
+    }
   }
+}
 
-  sourceBody->force.x += fx;
-  sourceBody->force.y += fy;
-  sourceBody->force.z += fz;
+template <typename Real, int Dim>
+void QuadTree<Real, Dim>::updateGroupForces(const QuadTreeNode<Real, Dim> &leaf, const InteractionList<Real, Dim> &list) {
+  double gravity = layoutSettings->gravity;
+  size_t count = list.mass.size();
+  const Real *position[Dim];
+  for (int axis = 0; axis < Dim; ++axis) position[axis] = list.pos[axis].data();
+
+  for (int j = leaf.firstBody; j < leaf.firstBody + leaf.bodyCount; ++j) {
+    int body = order[j];
+    if ((size_t)body >= targetCount) continue;
+    // The list holds the body itself, at zero distance it adds nothing.
+    Real point[Dim];
+    for (int axis = 0; axis < Dim; ++axis) point[axis] = sortedPos[axis][j];
+    double force[Dim] = {};
+    kernels->repulsion(position, list.mass.data(), count, point, force);
+
+    double coeff = gravity * sortedMass[j];
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies->force[axis][body] = coeff * force[axis];
+    }
+  }
 }
 
+template class QuadTree<float, 2>;
+template class QuadTree<float, 3>;
+template class QuadTree<double, 2>;
+template class QuadTree<double, 3>;
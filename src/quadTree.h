@@ -10,66 +10,153 @@
 #define __layout____quadTree__
 
 #include <vector>
+#include <cstdint>
 #include "primitives.h"
-#include "Random.h"
+#include "kernels.h"
 
+// Nodes live in one contiguous arena (QuadTree::nodes) in breadth-first
+// order, so children of a node are stored next to each other and the
+// traversal walks memory level by level.
+template <typename Real, int Dim>
 struct QuadTreeNode {
-  QuadTreeNode *quads[8];
-  Body *body;
-  double mass;
-  Vector3 massVector;
-  double left;
-  double right;
-  double top;
-  double bottom;
-  double front;
-  double back;
- 
-  void reset() {
-    quads[0] = quads[1] = quads[2] = quads[3] = quads[4] = quads[5] = quads[6] = quads[7] = NULL;
-    body = NULL;
-    massVector.reset();
-    mass = 0;
-    left = right = top = bottom = front = back = 0;
-  }
+  Real center[Dim];     // geometric center of the cell
+  Real halfWidth;       // cells are squares (cubes), this is half of their side
+  Real massCenter[Dim]; // center of mass of all bodies in the cell
+  Real mass;
+  // Index of the first child in the arena. Children follow it in the order
+  // of quads that are set in childMask: bit `axis` of a quad index is set
+  // for the upper half along that axis (bit 0 - eastern half, bit 1 -
+  // south, bit 2 - front), so a node has up to 2^Dim children.
+  uint32_t firstChild;
+  uint32_t childMask;
+  // Leaf nodes own bodies QuadTree::order[firstBody] ... order[firstBody + bodyCount - 1].
+  // A leaf holds up to LayoutSettings::leafCapacity bodies (more only when
+  // they still share a cell at the deepest level of the tree).
+  // Internal nodes have bodyCount == 0.
+  int firstBody;
+  int bodyCount;
 };
 
-class NodePool {
-  size_t currentAvailable = 0;
-  std::vector<QuadTreeNode *> pool;
-public:
-  void reset() {
-    currentAvailable = 0;
+// Everything that acts on a group of bodies (one leaf of the tree): centers
+// of mass of nodes far enough from the group and individual bodies of nearby
+// leaves. Vectors keep their capacity between leaves, and the arrays are
+// passed as is to ForceKernels::repulsion.
+template <typename Real, int Dim>
+struct InteractionList {
+  std::vector<Real> pos[Dim];
+  std::vector<Real> mass;
+
+  void clear() {
+    for (int axis = 0; axis < Dim; ++axis) pos[axis].clear();
+    mass.clear();
   }
 
-  QuadTreeNode* get() {
-    QuadTreeNode *result;
-    if (currentAvailable < pool.size()) {
-      result = pool[currentAvailable];
-      result->reset();
-    } else {
-      result = new QuadTreeNode();
-      pool.push_back(result);
-    }
-    currentAvailable += 1;
-    return result;
+  void add(const Real *point, Real _mass) {
+    for (int axis = 0; axis < Dim; ++axis) pos[axis].push_back(point[axis]);
+    mass.push_back(_mass);
   }
 };
 
+// How the tree was brought up to date on every step.
+struct TreeStats {
+  size_t rebuilds = 0;
+  size_t refits = 0;
+};
+
+// Tree over bodies of a BodyStore: a quadtree in 2D, an octree in 3D.
+// Positions, centers of mass and interactions are stored in `Real`; sums
+// over many bodies (centers of mass, total force on a body) are
+// accumulated in double.
+template <typename Real, int Dim>
 class QuadTree {
-  Random random;
   const LayoutSettings *layoutSettings;
-  NodePool treeNodes;
-  QuadTreeNode *root;
-  QuadTreeNode *createRootNode(std::vector<Body> &bodies);
-  void insert(Body *body, QuadTreeNode *node);
+  const ForceKernels<Real, Dim> *kernels;
+  BodyStore<Real, Dim> *bodies;
+
+  std::vector<QuadTreeNode<Real, Dim>> nodes;
+  // Nodes of depth `d` occupy [levelStart[d], levelStart[d + 1]) of the
+  // arena, so that each level can be split (top down) and summarized
+  // (bottom up) in parallel.
+  std::vector<size_t> levelStart;
+  std::vector<size_t> childOffsets;
+
+  // Bodies sorted by Morton key of their position. Each tree node covers
+  // a contiguous range of this array.
+  std::vector<uint64_t> keys;
+  std::vector<int> order;
+  std::vector<uint64_t> keysBuffer;
+  std::vector<int> orderBuffer;
+  // Positions and masses in `order`, so that leaf buckets are contiguous.
+  std::vector<Real> sortedPos[Dim];
+  std::vector<Real> sortedMass;
+
+  // Bodies from targetCount on are sources only, see insertBodies().
+  size_t targetCount;
+
+  TreeStats stats;
+  // After a refit fails, the next `refitSkips` steps rebuild without
+  // trying, and every failure in a row doubles the wait (refitBackoff).
+  size_t refitSkips, refitBackoff;
+
+  // See LayoutSettings::numa.
+  InterleavedArray interleavedNodes, interleavedPos[Dim], interleavedMass;
+
+  void findBounds(double *low, double *high);
+  void createRootNode(const double *low, const double *high);
+  void sortBodies();
+  void gatherSorted();
+  bool separateDuplicates(size_t step);
+  bool splitLevel(size_t depth);
+  void splitLevels();
+  void updateInterleaved();
+  // Both take the bounds of the bodies, and update them when they move
+  // bodies apart.
+  void rebuild(size_t step, double *low, double *high);
+  bool refit(size_t step, double *low, double *high);
+  void updateMass();
+  void collectInteractions(const QuadTreeNode<Real, Dim> &leaf, InteractionList<Real, Dim> &list);
+  void updateGroupForces(const QuadTreeNode<Real, Dim> &leaf, const InteractionList<Real, Dim> &list);
 public:
   QuadTree(const LayoutSettings& _settings) {
     layoutSettings = &_settings;
-    random = Random(1984);
+    bodies = NULL;
+    targetCount = 0;
+    refitSkips = 0;
+    refitBackoff = 1;
+    kernels = &selectKernels<Real, Dim>();
+  }
+  // Builds the tree, or refits the previous one (see
+  // LayoutSettings::treeRefit). `step` keys the random offsets that
+  // separate bodies at the same position.
+  void insertBodies(BodyStore<Real, Dim> &bodies, size_t step);
+  // Same, but only the first `targets` bodies are moved and get forces: the
+  // others are sources of repulsion only, which keep their place and whose
+  // forces are left as they are (see ShardedLayout).
+  void insertBodies(BodyStore<Real, Dim> &bodies, size_t step, size_t targets);
+  // Forgets the tree and its stats, so that the next insertBodies()
+  // rebuilds it: for bodies that were replaced rather than moved.
+  void reset() {
+    nodes.clear();
+    order.clear();
+    bodies = NULL;
+    targetCount = 0;
+    refitSkips = 0;
+    refitBackoff = 1;
+    stats = TreeStats();
   }
-  void insertBodies(std::vector<Body> &bodies);
-  void updateBodyForce(Body *sourceBody);
+  // Both return the number of bodies and cells the bodies interacted with.
+  size_t updateBodyForce(size_t sourceBody);
+  // Sets repulsion force of every body using one tree walk per leaf.
+  size_t updateGroupForces();
+
+  // Read-only view of the last built tree for other force engines.
+  const std::vector<QuadTreeNode<Real, Dim>> &getNodes() const { return nodes; }
+  const std::vector<size_t> &getLevelStart() const { return levelStart; }
+  const std::vector<int> &getOrder() const { return order; }
+  size_t getTargetCount() const { return targetCount; }
+  const std::vector<Real> &getSortedPos(int axis) const { return sortedPos[axis]; }
+  const std::vector<Real> &getSortedMass() const { return sortedMass; }
+  const TreeStats &getStats() const { return stats; }
 };
 
 #endif /* defined(__layout____quadTree__) */
@@ -0,0 +1,26 @@
+//
+//  repulsion.cpp
+//  layout++
+//
+
+#include "repulsion.h"
+
+template <typename Real, int Dim>
+size_t BarnesHut<Real, Dim>::updateForces(QuadTree<Real, Dim> &tree, BodyStore<Real, Dim> &bodies) {
+  if (settings->groupTraversal) {
+    return tree.updateGroupForces();
+  }
+
+  size_t interactions = 0;
+  #pragma omp parallel for reduction(+:interactions)
+  for (size_t i = 0; i < tree.getTargetCount(); i++) {
+    for (int axis = 0; axis < Dim; ++axis) bodies.force[axis][i] = 0;
+    interactions += tree.updateBodyForce(i);
+  }
+  return interactions;
+}
+
+template class BarnesHut<float, 2>;
+template class BarnesHut<float, 3>;
+template class BarnesHut<double, 2>;
+template class BarnesHut<double, 3>;
@@ -0,0 +1,34 @@
+//
+//  repulsion.h
+//  layout++
+//
+
+#ifndef __layout____repulsion__
+#define __layout____repulsion__
+
+#include "primitives.h"
+#include "quadTree.h"
+
+// Computes repulsion between all bodies. Layout picks an engine according
+// to LayoutSettings::repulsion; engines share the tree that is rebuilt
+// every step.
+template <typename Real, int Dim>
+class RepulsionEngine {
+public:
+  virtual ~RepulsionEngine() {}
+  // Sets (not adds) repulsion force of every body but the sources of the
+  // tree (see QuadTree::insertBodies()). `tree` is already built over
+  // current positions of `bodies`. Returns the number of interactions:
+  // bodies and cells that some body was repelled by, summed over bodies.
+  virtual size_t updateForces(QuadTree<Real, Dim> &tree, BodyStore<Real, Dim> &bodies) = 0;
+};
+
+template <typename Real, int Dim>
+class BarnesHut : public RepulsionEngine<Real, Dim> {
+  const LayoutSettings *settings;
+public:
+  BarnesHut(const LayoutSettings &_settings) : settings(&_settings) {}
+  size_t updateForces(QuadTree<Real, Dim> &tree, BodyStore<Real, Dim> &bodies);
+};
+
+#endif /* defined(__layout____repulsion__) */
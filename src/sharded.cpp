@@ -0,0 +1,654 @@
+//
+//  sharded.cpp
+//  layout++
+//
+
+#include "sharded.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+namespace {
+  double lap(chrono::steady_clock::time_point &start) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double, milli>(now - start).count();
+    start = now;
+    return elapsed;
+  }
+
+  // Shard of the initial range of ids that holds `id`: shard s starts with
+  // ids [count * s / shards, count * (s + 1) / shards).
+  int rangeShard(size_t id, size_t count, int shards) {
+    int shard = (int)(id * shards / count);
+    while (shard + 1 < shards && count * (shard + 1) / shards <= id) ++shard;
+    while (shard > 0 && count * shard / shards > id) --shard;
+    return shard;
+  }
+
+  // Index of the first marker at or after `i`, or `size`.
+  long rowStart(const int *links, long size, long i) {
+    while (i < size && links[i] >= 0) ++i;
+    return i;
+  }
+
+  // Morton key of a point quantized to `bits` per axis. Bits of the axes
+  // are interleaved, most significant first.
+  template <int Dim>
+  uint64_t mortonKey(const uint64_t *cell, int bits) {
+    uint64_t key = 0;
+    for (int bit = bits - 1; bit >= 0; --bit) {
+      for (int axis = Dim - 1; axis >= 0; --axis) {
+        key = (key << 1) | ((cell[axis] >> bit) & 1);
+      }
+    }
+    return key;
+  }
+}
+
+template <typename Real, int Dim>
+ShardedLayout<Real, Dim>::ShardedLayout(Transport &_transport) :
+  transport(&_transport), iteration(0), bodyCount(0), owned(0),
+  tree(settings), barnesHut(settings), multipole(settings), kernels(&selectKernels<Real, Dim>()) {}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::init(const int *links, long size) {
+  loadLinks(links, size);
+
+  // Layout places bodies next to the neighbours placed before them, which
+  // needs the whole graph in order. Shards draw the same random positions
+  // Layout gives to bodies without placed neighbours instead.
+  CounterRandom initial(settings.seed, InitialPositionStream);
+  for (size_t i = 0; i < owned; ++i) {
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies.pos[axis][i] = initial.nextDouble(ids[i], 0, axis) * log(bodyCount) * 100;
+    }
+  }
+  rebalance();
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::init(const int *links, long linksSize, const int *initialPositions, size_t posSize) {
+  loadLinks(links, linksSize);
+  if (bodyCount * Dim != posSize) {
+    cout << "There are " << bodyCount << " nodes in the graph and " << endl
+    << posSize << " positions. It is expected that each body has exactly" << endl
+    << Dim << " Int32 records in the positions file (one per axis)." << endl;
+    throw "Positions file mismatch";
+  }
+  for (size_t i = 0; i < owned; ++i) {
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies.pos[axis][i] = initialPositions[(size_t)ids[i] * Dim + axis];
+    }
+  }
+  rebalance();
+}
+
+// Every shard reads the rows of about size / shards links, cut at markers,
+// and sends each link to the shards of its two ends. Shards start with
+// contiguous ranges of ids.
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::loadLinks(const int *links, long size) {
+  iteration = 0;
+  timings = StepTimings();
+  int shards = transport->size();
+  int rank = transport->rank();
+
+  // Targets before the first marker belong to body 0, as in Graph::build().
+  long begin = rank == 0 ? 0 : rowStart(links, size, size * rank / shards);
+  long end = rank + 1 == shards ? size : rowStart(links, size, size * (rank + 1) / shards);
+  int maxBodyId = 0;
+  for (long i = begin; i < end; ++i) {
+    int id = (links[i] < 0 ? -links[i] : links[i]) - 1;
+    if (id > maxBodyId) maxBodyId = id;
+  }
+  vector<char> mine;
+  MessageWriter maxWriter(mine);
+  maxWriter.put(maxBodyId);
+  vector<vector<char>> all;
+  transport->allGather(mine, all);
+  for (int shard = 0; shard < shards; ++shard) {
+    maxBodyId = max(maxBodyId, MessageReader(all[shard]).get<int>());
+  }
+  bodyCount = maxBodyId + 1;
+
+  size_t first = bodyCount * rank / shards;
+  owned = bodyCount * (rank + 1) / shards - first;
+  ids.resize(owned);
+  for (size_t i = 0; i < owned; ++i) ids[i] = first + i;
+
+  // Links arrive from shards in order of rank, which is the order of the
+  // rows, so every body lists its links in the order Layout does.
+  vector<vector<char>> outgoingLinks(shards), incomingLinks(shards), arrived;
+  int from = 0;
+  for (long i = begin; i < end; ++i) {
+    if (links[i] < 0) {
+      from = -links[i] - 1;
+    } else if (links[i] > 0) {
+      int to = links[i] - 1;
+      MessageWriter outgoing(outgoingLinks[rangeShard(from, bodyCount, shards)]);
+      outgoing.put(from);
+      outgoing.put(to);
+      MessageWriter incoming(incomingLinks[rangeShard(to, bodyCount, shards)]);
+      incoming.put(to);
+      incoming.put(from);
+    }
+  }
+
+  adjacency.assign(owned, vector<int>());
+  transport->exchange(outgoingLinks, arrived);
+  vector<vector<char>>().swap(outgoingLinks);
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(arrived[shard]);
+    while (!reader.done()) {
+      int body = reader.get<int>();
+      adjacency[body - first].push_back(reader.get<int>());
+    }
+  }
+  vector<vector<int>> incoming(owned);
+  transport->exchange(incomingLinks, arrived);
+  vector<vector<char>>().swap(incomingLinks);
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(arrived[shard]);
+    while (!reader.done()) {
+      int body = reader.get<int>();
+      incoming[body - first].push_back(reader.get<int>());
+    }
+  }
+
+  bodies.resize(0);
+  bodies.resize(owned);
+  for (size_t i = 0; i < owned; ++i) {
+    adjacency[i].insert(adjacency[i].end(), incoming[i].begin(), incoming[i].end());
+    bodies.mass[i] = 1 + adjacency[i].size()/3.0;
+  }
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::exchangeBoxes() {
+  double low[Dim] = {}, high[Dim] = {};
+  for (int axis = 0; axis < Dim; ++axis) {
+    if (owned == 0) continue;
+    low[axis] = high[axis] = bodies.pos[axis][0];
+    for (size_t i = 1; i < owned; ++i) {
+      low[axis] = min(low[axis], (double)bodies.pos[axis][i]);
+      high[axis] = max(high[axis], (double)bodies.pos[axis][i]);
+    }
+  }
+
+  vector<char> mine;
+  MessageWriter writer(mine);
+  writer.put<uint64_t>(owned);
+  writer.put(low, Dim);
+  writer.put(high, Dim);
+  vector<vector<char>> all;
+  transport->allGather(mine, all);
+
+  int shards = transport->size();
+  shardBodies.resize(shards);
+  shardBox.resize(shards * 2 * Dim);
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(all[shard]);
+    shardBodies[shard] = reader.get<uint64_t>();
+    reader.get(&shardBox[shard * 2 * Dim], 2 * Dim);
+  }
+}
+
+// Cuts the Morton curve over the bounding box of the graph into ranges of
+// equal numbers of bodies, estimated from a sample of keys of every shard,
+// and sends every body to the shard of its range.
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::rebalance() {
+  int shards = transport->size();
+  exchangeBoxes();
+
+  double low[Dim], high[Dim];
+  bool first = true;
+  for (int shard = 0; shard < shards; ++shard) {
+    if (shardBodies[shard] == 0) continue;
+    const double *box = &shardBox[shard * 2 * Dim];
+    for (int axis = 0; axis < Dim; ++axis) {
+      low[axis] = first ? box[axis] : min(low[axis], box[axis]);
+      high[axis] = first ? box[Dim + axis] : max(high[axis], box[Dim + axis]);
+    }
+    first = false;
+  }
+  if (first) return;
+
+  double width = 0;
+  for (int axis = 0; axis < Dim; ++axis) width = max(width, high[axis] - low[axis]);
+  if (width == 0) width = 1;
+  const int bits = Dim == 2 ? 31 : 21;
+  double scale = ((uint64_t(1) << bits) - 1) / width;
+
+  vector<uint64_t> keys(owned);
+  for (size_t i = 0; i < owned; ++i) {
+    uint64_t cell[Dim];
+    for (int axis = 0; axis < Dim; ++axis) cell[axis] = (bodies.pos[axis][i] - low[axis]) * scale;
+    keys[i] = mortonKey<Dim>(cell, bits);
+  }
+
+  // Every sampled key stands for the same share of its shard's bodies.
+  const size_t sampleSize = 1024;
+  vector<uint64_t> sorted(keys);
+  sort(sorted.begin(), sorted.end());
+  size_t count = min(owned, sampleSize);
+  vector<char> mine;
+  MessageWriter writer(mine);
+  writer.put<uint64_t>(owned);
+  writer.put<uint64_t>(count);
+  for (size_t k = 0; k < count; ++k) writer.put(sorted[(2 * k + 1) * owned / (2 * count)]);
+  vector<vector<char>> all;
+  transport->allGather(mine, all);
+
+  vector<pair<uint64_t, double>> samples;
+  double total = 0;
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(all[shard]);
+    double bodiesOfShard = reader.get<uint64_t>();
+    size_t shardSamples = reader.get<uint64_t>();
+    for (size_t k = 0; k < shardSamples; ++k) {
+      samples.push_back(make_pair(reader.get<uint64_t>(), bodiesOfShard / shardSamples));
+    }
+    total += bodiesOfShard;
+  }
+  sort(samples.begin(), samples.end());
+
+  // Shard s gets keys in (splitters[s - 1], splitters[s]].
+  vector<uint64_t> splitters;
+  double seen = 0;
+  for (size_t k = 0; k < samples.size() && (int)splitters.size() < shards - 1; ++k) {
+    seen += samples[k].second;
+    while ((int)splitters.size() < shards - 1 && seen >= total * (splitters.size() + 1) / shards) {
+      splitters.push_back(samples[k].first);
+    }
+  }
+  splitters.resize(shards - 1, UINT64_MAX);
+
+  vector<vector<char>> outgoing(shards), incoming;
+  for (size_t i = 0; i < owned; ++i) {
+    int shard = upper_bound(splitters.begin(), splitters.end(), keys[i]) - splitters.begin();
+    MessageWriter body(outgoing[shard]);
+    body.put(ids[i]);
+    for (int axis = 0; axis < Dim; ++axis) body.put(bodies.pos[axis][i]);
+    for (int axis = 0; axis < Dim; ++axis) body.put(bodies.velocity[axis][i]);
+    body.put(bodies.mass[i]);
+    body.put<int>(adjacency[i].size());
+    body.put(adjacency[i].data(), adjacency[i].size());
+  }
+  transport->exchange(outgoing, incoming);
+  vector<vector<char>>().swap(outgoing);
+
+  // Bodies are kept in order of id, so that one shard steps them in the
+  // order Layout does.
+  vector<pair<int, size_t>> arrived; // id, then index in the order of arrival
+  vector<Real> state;                // position, velocity and mass of every body
+  vector<vector<int>> arrivedLinks;
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(incoming[shard]);
+    while (!reader.done()) {
+      arrived.push_back(make_pair(reader.get<int>(), arrived.size()));
+      state.resize(arrived.size() * (2 * Dim + 1));
+      reader.get(&state[(arrived.size() - 1) * (2 * Dim + 1)], 2 * Dim + 1);
+      arrivedLinks.push_back(vector<int>(reader.get<int>()));
+      reader.get(arrivedLinks.back().data(), arrivedLinks.back().size());
+    }
+    vector<char>().swap(incoming[shard]);
+  }
+  sort(arrived.begin(), arrived.end());
+
+  owned = arrived.size();
+  ids.resize(owned);
+  adjacency.resize(owned);
+  bodies.resize(owned);
+  for (size_t i = 0; i < owned; ++i) {
+    ids[i] = arrived[i].first;
+    const Real *body = &state[arrived[i].second * (2 * Dim + 1)];
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies.pos[axis][i] = body[axis];
+      bodies.velocity[axis][i] = body[Dim + axis];
+    }
+    bodies.mass[i] = body[2 * Dim];
+    adjacency[i].swap(arrivedLinks[arrived[i].second]);
+  }
+
+  locateLinked();
+  buildSprings();
+}
+
+// Bodies report where they are now to a directory: the shard of their
+// initial range of ids. Shards ask it where their linked bodies are, so no
+// shard keeps the location of every body.
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::locateLinked() {
+  int shards = transport->size();
+  int rank = transport->rank();
+  size_t first = bodyCount * rank / shards;
+  vector<int> location(bodyCount * (rank + 1) / shards - first);
+
+  vector<vector<char>> outgoing(shards), incoming;
+  for (size_t i = 0; i < owned; ++i) {
+    MessageWriter(outgoing[rangeShard(ids[i], bodyCount, shards)]).put(ids[i]);
+  }
+  transport->exchange(outgoing, incoming);
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(incoming[shard]);
+    while (!reader.done()) location[reader.get<int>() - first] = shard;
+  }
+
+  linked.clear();
+  for (size_t i = 0; i < owned; ++i) linked.insert(linked.end(), adjacency[i].begin(), adjacency[i].end());
+  sort(linked.begin(), linked.end());
+  linked.erase(unique(linked.begin(), linked.end()), linked.end());
+  outgoing.assign(shards, vector<char>());
+  for (size_t k = 0; k < linked.size(); ++k) {
+    MessageWriter(outgoing[rangeShard(linked[k], bodyCount, shards)]).put(linked[k]);
+  }
+  transport->exchange(outgoing, incoming);
+
+  // Answers go back in the order of the questions.
+  for (int shard = 0; shard < shards; ++shard) {
+    outgoing[shard].clear();
+    MessageReader reader(incoming[shard]);
+    MessageWriter writer(outgoing[shard]);
+    while (!reader.done()) writer.put(location[reader.get<int>() - first]);
+  }
+  vector<vector<char>> answers;
+  transport->exchange(outgoing, answers);
+  vector<MessageReader> readers(answers.begin(), answers.end());
+  linkedShard.resize(linked.size());
+  for (size_t k = 0; k < linked.size(); ++k) {
+    linkedShard[k] = readers[rangeShard(linked[k], bodyCount, shards)].get<int>();
+  }
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::buildSprings() {
+  int shards = transport->size();
+  int rank = transport->rank();
+
+  // Ghosts are listed by both ends in order of global id: links are
+  // symmetric, so the bodies shard j needs from this one are exactly the
+  // owned bodies linked to a body of shard j.
+  vector<vector<int>> needed(shards);
+  ghostSend.assign(shards, vector<int>());
+  for (size_t i = 0; i < owned; ++i) {
+    for (size_t k = 0; k < adjacency[i].size(); ++k) {
+      int shard = linkedShard[lower_bound(linked.begin(), linked.end(), adjacency[i][k]) - linked.begin()];
+      if (shard == rank) continue;
+      needed[shard].push_back(adjacency[i][k]);
+      if (ghostSend[shard].empty() || ghostSend[shard].back() != (int)i) ghostSend[shard].push_back(i);
+    }
+  }
+  ghostStart.assign(shards + 1, 0);
+  for (int shard = 0; shard < shards; ++shard) {
+    sort(needed[shard].begin(), needed[shard].end());
+    needed[shard].erase(unique(needed[shard].begin(), needed[shard].end()), needed[shard].end());
+    ghostStart[shard + 1] = ghostStart[shard] + needed[shard].size();
+  }
+  for (int axis = 0; axis < Dim; ++axis) ghostPos[axis].resize(ghostStart[shards]);
+
+  springOffsets.assign(owned + 1, 0);
+  springTargets.clear();
+  for (size_t i = 0; i < owned; ++i) {
+    for (size_t k = 0; k < adjacency[i].size(); ++k) {
+      int id = adjacency[i][k];
+      int shard = linkedShard[lower_bound(linked.begin(), linked.end(), id) - linked.begin()];
+      if (shard == rank) {
+        springTargets.push_back(lower_bound(ids.begin(), ids.end(), id) - ids.begin());
+      } else {
+        vector<int> &ghosts = needed[shard];
+        springTargets.push_back(owned + ghostStart[shard] + (lower_bound(ghosts.begin(), ghosts.end(), id) - ghosts.begin()));
+      }
+    }
+    springOffsets[i + 1] = springTargets.size();
+  }
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::exchangeGhosts() {
+  int shards = transport->size();
+  vector<vector<char>> outgoing(shards), incoming;
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageWriter writer(outgoing[shard]);
+    for (size_t k = 0; k < ghostSend[shard].size(); ++k) {
+      for (int axis = 0; axis < Dim; ++axis) writer.put(bodies.pos[axis][ghostSend[shard][k]]);
+    }
+  }
+  transport->exchange(outgoing, incoming);
+
+  for (int shard = 0; shard < shards; ++shard) {
+    MessageReader reader(incoming[shard]);
+    for (size_t g = ghostStart[shard]; g < ghostStart[shard + 1]; ++g) {
+      for (int axis = 0; axis < Dim; ++axis) ghostPos[axis][g] = reader.get<Real>();
+    }
+    if (!reader.done()) throw "Unexpected number of ghost bodies";
+  }
+}
+
+// Walks the tree of owned bodies as QuadTree::collectInteractions() does for
+// a leaf, with the bounding box of another shard as the group.
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::exportSources(int shard, vector<char> &message) {
+  const vector<QuadTreeNode<Real, Dim>> &nodes = tree.getNodes();
+  const vector<Real> &mass = tree.getSortedMass();
+  const double *low = &shardBox[shard * 2 * Dim], *high = low + Dim;
+  MessageWriter writer(message);
+
+  vector<uint32_t> stack(1, 0);
+  while (!stack.empty()) {
+    const QuadTreeNode<Real, Dim> &node = nodes[stack.back()];
+    stack.pop_back();
+    if (node.bodyCount != 1) {
+      double r2 = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        double d = max(0.0, max(low[axis] - node.massCenter[axis], node.massCenter[axis] - high[axis]));
+        r2 += d * d;
+      }
+      double r = sqrt(r2);
+
+      if (r > 0 && 2 * node.halfWidth / r < settings.theta) {
+        writer.put(node.massCenter, Dim);
+        writer.put(node.mass);
+        continue;
+      }
+
+      if (node.bodyCount == 0) {
+        uint32_t childEnd = node.firstChild + __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < childEnd; ++child) stack.push_back(child);
+        continue;
+      }
+    }
+
+    for (int j = node.firstBody; j < node.firstBody + node.bodyCount; ++j) {
+      for (int axis = 0; axis < Dim; ++axis) writer.put(tree.getSortedPos(axis)[j]);
+      writer.put(mass[j]);
+    }
+  }
+}
+
+template <typename Real, int Dim>
+RepulsionEngine<Real, Dim> *ShardedLayout<Real, Dim>::repulsion() {
+  if (settings.repulsion == RepulsionMethod::Multipole) return &multipole;
+  return &barnesHut;
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::accumulate() {
+  int shards = transport->size();
+  int rank = transport->rank();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  exchangeGhosts();
+  exchangeBoxes();
+
+  // The tree over owned bodies is only needed when another shard has
+  // bodies. Without sources from other shards it is the final one.
+  bool others = false;
+  for (int shard = 0; shard < shards; ++shard) others = others || (shard != rank && shardBodies[shard] > 0);
+  bodies.resize(owned);
+  vector<vector<char>> outgoing(shards), incoming;
+  if (owned > 0 && others) {
+    tree.insertBodies(bodies, iteration);
+    for (int shard = 0; shard < shards; ++shard) {
+      if (shard != rank && shardBodies[shard] > 0) exportSources(shard, outgoing[shard]);
+    }
+  }
+  transport->exchange(outgoing, incoming);
+
+  size_t imported = 0;
+  for (int shard = 0; shard < shards; ++shard) {
+    if (shard != rank) imported += incoming[shard].size() / ((Dim + 1) * sizeof(Real));
+  }
+  bodies.resize(owned + imported);
+  size_t source = owned;
+  for (int shard = 0; shard < shards; ++shard) {
+    if (shard == rank) continue;
+    MessageReader reader(incoming[shard]);
+    while (!reader.done()) {
+      for (int axis = 0; axis < Dim; ++axis) bodies.pos[axis][source] = reader.get<Real>();
+      bodies.mass[source++] = reader.get<Real>();
+    }
+  }
+  if (owned > 0 && (!others || imported > 0)) tree.insertBodies(bodies, iteration, owned);
+  timings.tree += lap(start);
+
+  if (owned > 0) repulsion()->updateForces(tree, bodies);
+  timings.repulsion += lap(start);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < owned; i++) {
+    for (int axis = 0; axis < Dim; ++axis) {
+      bodies.force[axis][i] -= settings.dragCoeff * bodies.velocity[axis][i];
+    }
+  }
+
+  #pragma omp parallel
+  {
+    SpringBatch<Real, Dim> batch;
+
+    #pragma omp for
+    for (size_t i = 0; i < owned; i++) {
+      updateSpringForce(i, batch);
+    }
+  }
+  timings.springs += lap(start);
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::updateSpringForce(size_t body, SpringBatch<Real, Dim> &batch) {
+  const int *neighbours = springTargets.data() + springOffsets[body];
+  size_t count = springOffsets[body + 1] - springOffsets[body];
+  batch.resize(count);
+  const Real *position[Dim];
+  Real point[Dim];
+  for (int axis = 0; axis < Dim; ++axis) {
+    for (size_t i = 0; i < count; ++i) {
+      size_t target = neighbours[i];
+      batch.pos[axis][i] = target < owned ? bodies.pos[axis][target] : ghostPos[axis][target - owned];
+    }
+    position[axis] = batch.pos[axis].data();
+    point[axis] = bodies.pos[axis][body];
+  }
+
+  double force[Dim] = {};
+  kernels->springs(position, count, point, (Real)settings.springLength,
+                   (Real)settings.springCoeff, force);
+
+  for (int axis = 0; axis < Dim; ++axis) {
+    bodies.force[axis][body] += force[axis];
+  }
+}
+
+// Same as Layout::integrate() over owned bodies. Shards add their totals in
+// order of rank.
+template <typename Real, int Dim>
+double ShardedLayout<Real, Dim>::integrate() {
+  double timeStep = settings.timeStep;
+  const size_t blockSize = 4096;
+  size_t blocks = (owned + blockSize - 1) / blockSize;
+  movement.assign(blocks * Dim, 0);
+
+  #pragma omp parallel for
+  for (size_t block = 0; block < blocks; ++block) {
+    double *total = &movement[block * Dim];
+    size_t end = min(owned, (block + 1) * blockSize);
+    for (size_t i = block * blockSize; i < end; i++) {
+      double coeff = timeStep / bodies.mass[i];
+
+      double velocity[Dim], v = 0;
+      for (int axis = 0; axis < Dim; ++axis) {
+        velocity[axis] = bodies.velocity[axis][i] + coeff * bodies.force[axis][i];
+        v += velocity[axis] * velocity[axis];
+      }
+      v = sqrt(v);
+
+      for (int axis = 0; axis < Dim; ++axis) {
+        if (v > 1) velocity[axis] = velocity[axis] / v;
+        bodies.velocity[axis][i] = velocity[axis];
+
+        double d = timeStep * velocity[axis];
+        bodies.pos[axis][i] += d;
+        total[axis] += abs(d);
+      }
+    }
+  }
+
+  double shardTotal[Dim] = {};
+  for (size_t block = 0; block < blocks; ++block) {
+    for (int axis = 0; axis < Dim; ++axis) shardTotal[axis] += movement[block * Dim + axis];
+  }
+  vector<char> mine;
+  MessageWriter writer(mine);
+  writer.put(shardTotal, Dim);
+  vector<vector<char>> all;
+  transport->allGather(mine, all);
+
+  double total[Dim] = {};
+  for (int shard = 0; shard < transport->size(); ++shard) {
+    MessageReader reader(all[shard]);
+    for (int axis = 0; axis < Dim; ++axis) total[axis] += reader.get<double>();
+  }
+  double result = 0;
+  for (int axis = 0; axis < Dim; ++axis) result += total[axis] * total[axis];
+  return result/bodyCount;
+}
+
+template <typename Real, int Dim>
+bool ShardedLayout<Real, Dim>::step() {
+  if (settings.integrator != Integrator::Velocity) throw "ShardedLayout only supports Integrator::Velocity";
+  if (iteration > 0 && settings.rebalanceInterval > 0 && iteration % settings.rebalanceInterval == 0) {
+    rebalance();
+  }
+  accumulate();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  double totalMovement = integrate();
+  timings.integrate += lap(start);
+  iteration += 1;
+  return totalMovement < settings.stableThreshold;
+}
+
+template <typename Real, int Dim>
+void ShardedLayout<Real, Dim>::getPositions(int *positions) {
+  vector<vector<char>> outgoing(transport->size()), incoming;
+  MessageWriter writer(outgoing[0]);
+  for (size_t i = 0; i < owned; ++i) {
+    writer.put(ids[i]);
+    for (int axis = 0; axis < Dim; ++axis) writer.put<int>(floor(bodies.pos[axis][i] + 0.5));
+  }
+  transport->exchange(outgoing, incoming);
+  if (transport->rank() != 0) return;
+
+  for (size_t shard = 0; shard < incoming.size(); ++shard) {
+    MessageReader reader(incoming[shard]);
+    while (!reader.done()) {
+      int id = reader.get<int>();
+      reader.get(positions + (size_t)id * Dim, Dim);
+    }
+  }
+}
+
+template class ShardedLayout<float, 2>;
+template class ShardedLayout<float, 3>;
+template class ShardedLayout<double, 2>;
+template class ShardedLayout<double, 3>;
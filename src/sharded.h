@@ -0,0 +1,107 @@
+//
+//  sharded.h
+//  layout++
+//
+
+#ifndef __layout____sharded__
+#define __layout____sharded__
+
+#include <vector>
+#include "primitives.h"
+#include "quadTree.h"
+#include "repulsion.h"
+#include "multipole.h"
+#include "kernels.h"
+#include "transport.h"
+#include "layout.h"
+
+using namespace std;
+
+// Layout split between processes (shards) by region of space. Every shard
+// owns the bodies of one range of Morton keys over the bounding box of the
+// whole graph, and keeps state and links of its own bodies only. On every
+// step:
+//  - shards swap positions of ghost bodies: bodies of other shards linked
+//    to their own ones, so that springs across shards pull both ends;
+//  - each shard builds a tree over its bodies and sends every other shard
+//    what that shard's bodies feel from them: the center of mass of cells
+//    far enough from its bounding box (by the test of LayoutSettings::theta)
+//    and the bodies of leaves that are not. The receiving shard adds them to
+//    its tree as sources of repulsion only: they get no forces, and never
+//    move its bodies apart (see QuadTree::insertBodies());
+//  - bodies move with Integrator::Velocity.
+// Every rebalanceInterval steps, bodies move to the shard of their current
+// region, together with their links.
+//
+// One shard gives the same layout as Layout from the same positions. With
+// more shards, forces from other shards are approximated by their cells
+// alone, so layouts differ slightly. Every method is collective: all shards
+// call it in the same order.
+template <typename Real = double, int Dim = 3>
+class ShardedLayout {
+  Transport *transport;
+  LayoutSettings settings;
+  size_t iteration;
+  size_t bodyCount;              // in the whole graph
+  size_t owned;                  // bodies of this shard, first in `bodies`
+  vector<int> ids;               // global id of every owned body, ascending
+  // Global ids of bodies linked to every owned body: outgoing links, then
+  // incoming ones, as Graph::neighbours() lists them.
+  vector<vector<int>> adjacency;
+  // Every body linked to an owned one, ascending, and the shard it is on.
+  vector<int> linked;
+  vector<int> linkedShard;
+  BodyStore<Real, Dim> bodies;   // owned bodies, then sources from other shards
+  QuadTree<Real, Dim> tree;
+  BarnesHut<Real, Dim> barnesHut;
+  Multipole<Real, Dim> multipole;
+  const ForceKernels<Real, Dim> *kernels;
+
+  // Springs of owned bodies. A target below `owned` is an owned body, from
+  // `owned` on it is ghost `target - owned`.
+  vector<size_t> springOffsets;
+  vector<int> springTargets;
+  // Ghosts from shard j are ghostStart[j] ... ghostStart[j + 1] - 1, in
+  // order of global id. ghostSend[j] are the owned bodies shard j needs.
+  vector<Real> ghostPos[Dim];
+  vector<size_t> ghostStart;
+  vector<vector<int>> ghostSend;
+  // Bodies and bounding box (low, then high corner) of every shard.
+  vector<size_t> shardBodies;
+  vector<double> shardBox;
+  vector<double> movement;
+  StepTimings timings;
+
+  RepulsionEngine<Real, Dim> *repulsion();
+  void loadLinks(const int *links, long size);
+  void exchangeBoxes();
+  void rebalance();
+  void locateLinked();
+  void buildSprings();
+  void exchangeGhosts();
+  void exportSources(int shard, vector<char> &message);
+  void accumulate();
+  void updateSpringForce(size_t body, SpringBatch<Real, Dim> &batch);
+  double integrate();
+public:
+  // The transport must outlive the layout.
+  ShardedLayout(Transport &transport);
+  // Every shard is handed the same links (e.g. the same MappedFile), and
+  // reads only its share of the rows; each keeps the links of its bodies.
+  void init(const int *links, long size);
+  // `initialPositions` holds `Dim` coordinates per body of the graph.
+  void init(const int *links, long linksSize, const int *initialPositions, size_t posSize);
+
+  bool step();
+  // In the whole graph, and in this shard.
+  size_t getBodiesCount() const { return bodyCount; }
+  size_t getOwnedCount() const { return owned; }
+  const StepTimings &getTimings() const { return timings; }
+  // Settings are read on every step, and must be the same on all shards.
+  LayoutSettings *getSettings() { return &settings; }
+  // Collects positions of all bodies on shard 0, in the format of
+  // Layout::getPositions(). Other shards may pass NULL.
+  void getPositions(int *positions);
+};
+
+#endif /* defined(__layout____sharded__) */
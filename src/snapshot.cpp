@@ -0,0 +1,175 @@
+//
+//  snapshot.cpp
+//  layout++
+//
+
+#include "snapshot.h"
+#include <fstream>
+#include <iostream>
+#include <cstring>
+
+namespace {
+  const char deltaMagic[4] = { 'N', 'G', 'D', '1' };
+  const size_t noBuffer = (size_t)-1;
+
+  struct DeltaHeader {
+    char magic[4];
+    uint32_t count;
+    uint32_t keyframe;
+  };
+
+  void putVarint(vector<uint8_t> &out, int64_t value) {
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    while (zigzag >= 0x80) {
+      out.push_back((uint8_t)(zigzag | 0x80));
+      zigzag >>= 7;
+    }
+    out.push_back((uint8_t)zigzag);
+  }
+
+  bool getVarint(const uint8_t *&in, const uint8_t *end, int64_t &value) {
+    uint64_t zigzag = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+      uint8_t byte = *in++;
+      zigzag |= (uint64_t)(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+SnapshotWriter::SnapshotWriter(SnapshotFormat _format, int _keyframeInterval, size_t bufferCount) :
+  format(_format), keyframeInterval(_keyframeInterval < 1 ? 1 : _keyframeInterval),
+  buffers(bufferCount < 1 ? 1 : bufferCount), filling(noBuffer), stopping(false), stalls(0), written(0) {
+  for (size_t i = buffers.size(); i-- > 0;) freeBuffers.push_back(i);
+  worker = thread(&SnapshotWriter::run, this);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  flush();
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  changed.notify_all();
+  worker.join();
+}
+
+int *SnapshotWriter::acquire(size_t count) {
+  unique_lock<mutex> guard(lock);
+  if (filling == noBuffer) {
+    if (freeBuffers.empty()) {
+      // Backpressure: the writer is behind by a whole set of buffers.
+      stalls += 1;
+      changed.wait(guard, [this] { return !freeBuffers.empty(); });
+    }
+    filling = freeBuffers.back();
+    freeBuffers.pop_back();
+  }
+  Buffer &buffer = buffers[filling];
+  guard.unlock();
+
+  buffer.positions.resize(count);
+  return buffer.positions.data();
+}
+
+void SnapshotWriter::submit(const string &fileName) {
+  {
+    lock_guard<mutex> guard(lock);
+    if (filling == noBuffer) throw "Snapshot submitted without acquire()";
+    buffers[filling].fileName = fileName;
+    queue.push_back(filling);
+    filling = noBuffer;
+  }
+  changed.notify_all();
+}
+
+void SnapshotWriter::flush() {
+  unique_lock<mutex> guard(lock);
+  changed.wait(guard, [this] { return queue.empty(); });
+}
+
+size_t SnapshotWriter::getStalls() {
+  lock_guard<mutex> guard(lock);
+  return stalls;
+}
+
+void SnapshotWriter::run() {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    changed.wait(guard, [this] { return !queue.empty() || stopping; });
+    if (queue.empty()) return;
+
+    // The buffer stays in the queue while it is written, so that flush()
+    // returns only after the file is complete.
+    size_t index = queue.front();
+    guard.unlock();
+    write(buffers[index]);
+    guard.lock();
+
+    queue.erase(queue.begin());
+    freeBuffers.push_back(index);
+    changed.notify_all();
+  }
+}
+
+void SnapshotWriter::write(const Buffer &buffer) {
+  const vector<int> &positions = buffer.positions;
+  ofstream file(buffer.fileName, ofstream::binary);
+
+  if (format == SnapshotFormat::Raw) {
+    file.write((const char *)positions.data(), positions.size() * sizeof(int));
+  } else {
+    bool keyframe = written % keyframeInterval == 0 || previous.size() != positions.size();
+    if (keyframe) previous.assign(positions.size(), 0);
+
+    DeltaHeader header;
+    memcpy(header.magic, deltaMagic, sizeof(deltaMagic));
+    header.count = (uint32_t)positions.size();
+    header.keyframe = keyframe;
+
+    encoded.clear();
+    for (size_t i = 0; i < positions.size(); ++i) {
+      putVarint(encoded, (int64_t)positions[i] - previous[i]);
+    }
+    previous = positions;
+
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)encoded.data(), encoded.size());
+  }
+
+  written += 1;
+  if (!file) cerr << "Could not write snapshot " << buffer.fileName << endl;
+}
+
+void SnapshotReader::read(const char *fileName) {
+  ifstream file(fileName, ios::in | ios::binary | ios::ate);
+  if (!file.is_open()) throw "Could not read snapshot file";
+  vector<uint8_t> content((size_t)file.tellg());
+  file.seekg(0, ios::beg);
+  file.read((char *)content.data(), content.size());
+
+  DeltaHeader header;
+  if (content.size() < sizeof(header) || memcmp(content.data(), deltaMagic, sizeof(deltaMagic)) != 0) {
+    positions.resize(content.size() / sizeof(int));
+    memcpy(positions.data(), content.data(), positions.size() * sizeof(int));
+    return;
+  }
+
+  memcpy(&header, content.data(), sizeof(header));
+  if (header.keyframe) {
+    positions.assign(header.count, 0);
+  } else if (positions.size() != header.count) {
+    throw "Delta snapshot does not follow a snapshot of the same graph";
+  }
+
+  const uint8_t *in = content.data() + sizeof(header), *end = content.data() + content.size();
+  for (size_t i = 0; i < positions.size(); ++i) {
+    int64_t delta;
+    if (!getVarint(in, end, delta)) throw "Snapshot file is truncated";
+    positions[i] = (int)(positions[i] + delta);
+  }
+}
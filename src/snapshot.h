@@ -0,0 +1,96 @@
+//
+//  snapshot.h
+//  layout++
+//
+
+#ifndef __layout____snapshot__
+#define __layout____snapshot__
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+using namespace std;
+
+enum class SnapshotFormat {
+  // Int32 coordinates, `Dim` per body: the positions file init() reads.
+  Raw,
+  // Header, then every coordinate as a zigzag varint of its difference from
+  // the previous snapshot. Bodies move little between snapshots, so most
+  // values take one byte. Every `keyframeInterval`-th snapshot stores
+  // differences from zero and can be read on its own.
+  Delta
+};
+
+// Writes position snapshots on a background thread, so that the layout
+// keeps stepping while files are encoded and written:
+//
+//   int *buffer = writer.acquire(layout.getBodiesCount() * 3);
+//   layout.getPositions(buffer);
+//   writer.submit("42.bin");
+//
+// Buffers are reused. When the writer falls behind and all of them are
+// queued, acquire() waits for the oldest one to be written, so memory stays
+// bounded.
+class SnapshotWriter {
+  struct Buffer {
+    vector<int> positions;
+    string fileName;
+  };
+
+  SnapshotFormat format;
+  int keyframeInterval;
+
+  vector<Buffer> buffers;
+  vector<size_t> freeBuffers;  // ready to be filled
+  vector<size_t> queue;        // filled, oldest first
+  size_t filling;              // acquired and not yet submitted
+  bool stopping;
+  size_t stalls;
+  mutex lock;
+  condition_variable changed;
+  thread worker;
+
+  // Owned by the worker thread.
+  vector<int> previous;
+  vector<uint8_t> encoded;
+  size_t written;
+
+  void run();
+  void write(const Buffer &buffer);
+
+  SnapshotWriter(const SnapshotWriter &);
+  SnapshotWriter &operator=(const SnapshotWriter &);
+public:
+  SnapshotWriter(SnapshotFormat format = SnapshotFormat::Raw, int keyframeInterval = 20,
+                 size_t bufferCount = 2);
+  // Writes everything that was submitted.
+  ~SnapshotWriter();
+
+  // Returns a buffer for `count` coordinates. Waits if all buffers are
+  // still queued for writing.
+  int *acquire(size_t count);
+  // Queues the acquired buffer to be written to `fileName`.
+  void submit(const string &fileName);
+  // Waits until every submitted snapshot is written.
+  void flush();
+  // Number of times acquire() had to wait for the writer.
+  size_t getStalls();
+};
+
+// Reads snapshots of either format. Delta snapshots are applied on top of
+// the previous one read, so they must be read in the order they were
+// written, starting from a keyframe.
+class SnapshotReader {
+  vector<int> positions;
+public:
+  // Throws if the file cannot be read, or if it is a delta that does not
+  // follow a snapshot of the same size.
+  void read(const char *fileName);
+  const vector<int> &getPositions() const { return positions; }
+};
+
+#endif /* defined(__layout____snapshot__) */
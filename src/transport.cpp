@@ -0,0 +1,231 @@
+//
+//  transport.cpp
+//  layout++
+//
+
+#include "transport.h"
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+void setNonBlocking(int socket) {
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+}
+
+sockaddr_un socketAddress(const string &path, int rank) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  string name = path + to_string(rank);
+  if (name.size() >= sizeof(address.sun_path)) throw "Socket path is too long";
+  strcpy(address.sun_path, name.c_str());
+  return address;
+}
+
+// Blocking transfer of the rank when named sockets connect.
+void sendRank(int socket, int rank) {
+  if (write(socket, &rank, sizeof(rank)) != sizeof(rank)) throw "Could not send shard rank";
+}
+
+int receiveRank(int socket) {
+  int rank;
+  if (read(socket, &rank, sizeof(rank)) != sizeof(rank)) throw "Could not receive shard rank";
+  return rank;
+}
+
+// One message in flight: 8 bytes of length, then data.
+struct Transfer {
+  uint64_t length;
+  size_t done;
+  Transfer() : length(0), done(0) {}
+};
+}
+
+SocketTransport::SocketTransport(int count) : shardRank(0), shardCount(count), peers(count, -1) {
+  if (count < 1) throw "Shard count must be positive";
+  vector<vector<int>> pairs(count, vector<int>(count, -1));
+  for (int i = 0; i < count; ++i) {
+    for (int j = i + 1; j < count; ++j) {
+      int ends[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) != 0) throw "Could not create socket pair";
+      pairs[i][j] = ends[0];
+      pairs[j][i] = ends[1];
+    }
+  }
+
+  for (int i = 1; i < count; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) throw "Could not fork shard";
+    if (pid == 0) {
+      shardRank = i;
+      children.clear();
+      break;
+    }
+    children.push_back(pid);
+  }
+
+  // Keep this shard's ends, close the rest.
+  for (int i = 0; i < count; ++i) {
+    for (int j = 0; j < count; ++j) {
+      if (pairs[i][j] < 0) continue;
+      if (i == shardRank) {
+        peers[j] = pairs[i][j];
+        setNonBlocking(peers[j]);
+      } else {
+        close(pairs[i][j]);
+      }
+    }
+  }
+}
+
+SocketTransport::SocketTransport(const string &path, int rank, int count) :
+  shardRank(rank), shardCount(count), peers(count, -1) {
+  if (count < 1 || rank < 0 || rank >= count) throw "Invalid shard rank";
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un own = socketAddress(path, rank);
+  unlink(own.sun_path);
+  if (bind(listener, (sockaddr *)&own, sizeof(own)) != 0 || listen(listener, count) != 0) {
+    throw "Could not listen on shard socket";
+  }
+
+  // Lower ranks may not listen yet: retry for up to a minute.
+  for (int j = 0; j < rank; ++j) {
+    sockaddr_un address = socketAddress(path, j);
+    int attempts = 0;
+    while (true) {
+      int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (connect(peer, (sockaddr *)&address, sizeof(address)) == 0) {
+        peers[j] = peer;
+        break;
+      }
+      close(peer);
+      if (++attempts == 6000) throw "Could not connect to shard";
+      usleep(10000);
+    }
+    sendRank(peers[j], rank);
+  }
+
+  for (int j = rank + 1; j < count; ++j) {
+    int peer = accept(listener, NULL, NULL);
+    if (peer < 0) throw "Could not accept shard connection";
+    int peerRank = receiveRank(peer);
+    if (peerRank <= rank || peerRank >= count || peers[peerRank] >= 0) throw "Unexpected shard rank";
+    peers[peerRank] = peer;
+  }
+  close(listener);
+  unlink(own.sun_path);
+
+  for (int j = 0; j < count; ++j) {
+    if (peers[j] >= 0) setNonBlocking(peers[j]);
+  }
+}
+
+SocketTransport::~SocketTransport() {
+  for (size_t j = 0; j < peers.size(); ++j) {
+    if (peers[j] >= 0) close(peers[j]);
+  }
+  for (size_t i = 0; i < children.size(); ++i) {
+    int status;
+    waitpid(children[i], &status, 0);
+  }
+}
+
+void SocketTransport::exchange(const vector<vector<char>> &outgoing, vector<vector<char>> &incoming) {
+  if ((int)outgoing.size() != shardCount) throw "Need one outgoing message per shard";
+  incoming.assign(shardCount, vector<char>());
+  incoming[shardRank] = outgoing[shardRank];
+
+  // Every shard sends and receives at once, so that large messages cannot
+  // block both ends of a socket.
+  vector<Transfer> sending(shardCount), receiving(shardCount);
+  vector<int> pending;
+  for (int j = 0; j < shardCount; ++j) {
+    if (j == shardRank) continue;
+    sending[j].length = outgoing[j].size();
+    pending.push_back(j);
+  }
+
+  const size_t header = sizeof(uint64_t);
+  vector<pollfd> polled;
+  vector<int> polledPeer;
+  while (true) {
+    polled.clear();
+    polledPeer.clear();
+    for (size_t k = 0; k < pending.size(); ++k) {
+      int j = pending[k];
+      short events = 0;
+      if (sending[j].done < header + sending[j].length) events |= POLLOUT;
+      if (receiving[j].done < header || receiving[j].done < header + receiving[j].length) events |= POLLIN;
+      if (events == 0) continue;
+      pollfd entry = { peers[j], events, 0 };
+      polled.push_back(entry);
+      polledPeer.push_back(j);
+    }
+    if (polled.empty()) break;
+
+    if (poll(&polled[0], polled.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      throw "Could not poll shard sockets";
+    }
+
+    for (size_t k = 0; k < polled.size(); ++k) {
+      int j = polledPeer[k];
+      short events = polled[k].revents;
+
+      if (events & POLLOUT) {
+        Transfer &out = sending[j];
+        while (out.done < header + out.length) {
+          const char *data;
+          size_t left;
+          if (out.done < header) {
+            data = (const char *)&out.length + out.done;
+            left = header - out.done;
+          } else {
+            data = &outgoing[j][out.done - header];
+            left = header + out.length - out.done;
+          }
+          ssize_t sent = send(peers[j], data, left, MSG_NOSIGNAL);
+          if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            throw "Could not send to shard";
+          }
+          out.done += sent;
+        }
+      }
+
+      if (events & (POLLIN | POLLHUP | POLLERR)) {
+        Transfer &in = receiving[j];
+        while (in.done < header || in.done < header + in.length) {
+          char *data;
+          size_t left;
+          if (in.done < header) {
+            data = (char *)&in.length + in.done;
+            left = header - in.done;
+          } else {
+            data = &incoming[j][in.done - header];
+            left = header + in.length - in.done;
+          }
+          ssize_t received = recv(peers[j], data, left, 0);
+          if (received == 0) throw "Shard disconnected";
+          if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            throw "Could not receive from shard";
+          }
+          in.done += received;
+          if (in.done == header) incoming[j].resize(in.length);
+        }
+      }
+    }
+  }
+}
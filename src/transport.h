@@ -0,0 +1,102 @@
+//
+//  transport.h
+//  layout++
+//
+
+#ifndef __layout____transport__
+#define __layout____transport__
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <sys/types.h>
+
+using namespace std;
+
+// Moves bytes between the shards of a ShardedLayout. Operations are
+// collective: every shard calls them in the same order.
+class Transport {
+public:
+  virtual ~Transport() {}
+  virtual int rank() const = 0;
+  virtual int size() const = 0;
+  // Sends outgoing[j] to shard j, for every j, and fills incoming[j] with
+  // what shard j sent to this one. outgoing[rank()] is copied to
+  // incoming[rank()].
+  virtual void exchange(const vector<vector<char>> &outgoing, vector<vector<char>> &incoming) = 0;
+
+  // Every shard gets `mine` of every shard.
+  void allGather(const vector<char> &mine, vector<vector<char>> &all) {
+    vector<vector<char>> outgoing(size(), mine);
+    exchange(outgoing, all);
+  }
+};
+
+// Shards of one machine, connected by Unix sockets.
+class SocketTransport : public Transport {
+  int shardRank, shardCount;
+  vector<int> peers;       // socket of every shard, -1 for this one
+  vector<pid_t> children;  // workers forked by this process
+
+  SocketTransport(const SocketTransport &);
+  SocketTransport &operator=(const SocketTransport &);
+public:
+  // Forks `count - 1` workers, connected to this process and to each other
+  // by socket pairs. The constructor returns in every process: with rank 0
+  // in the calling one, and the rank of the worker in each worker, which
+  // then runs the same code. Fork before any OpenMP parallel region: the
+  // OpenMP runtime of GCC does not survive fork() in the child otherwise.
+  explicit SocketTransport(int count);
+  // Connects processes started separately. Each one listens on the socket
+  // `path` + rank and connects to those of lower ranks.
+  SocketTransport(const string &path, int rank, int count);
+  // Closes the sockets. The process that forked workers waits for them.
+  ~SocketTransport();
+
+  int rank() const { return shardRank; }
+  int size() const { return shardCount; }
+  void exchange(const vector<vector<char>> &outgoing, vector<vector<char>> &incoming);
+};
+
+// Appends plain values to a message.
+class MessageWriter {
+  vector<char> &out;
+public:
+  MessageWriter(vector<char> &_out) : out(_out) {}
+
+  template <typename T>
+  void put(const T *values, size_t count) {
+    size_t offset = out.size();
+    out.resize(offset + count * sizeof(T));
+    if (count > 0) memcpy(&out[offset], values, count * sizeof(T));
+  }
+
+  template <typename T>
+  void put(const T &value) { put(&value, 1); }
+};
+
+// Reads values in the order a MessageWriter put them.
+class MessageReader {
+  const vector<char> &in;
+  size_t offset;
+public:
+  MessageReader(const vector<char> &_in) : in(_in), offset(0) {}
+
+  template <typename T>
+  void get(T *values, size_t count) {
+    if (offset + count * sizeof(T) > in.size()) throw "Message is truncated";
+    if (count > 0) memcpy(values, &in[offset], count * sizeof(T));
+    offset += count * sizeof(T);
+  }
+
+  template <typename T>
+  T get() {
+    T value;
+    get(&value, 1);
+    return value;
+  }
+
+  bool done() const { return offset == in.size(); }
+};
+
+#endif /* defined(__layout____transport__) */